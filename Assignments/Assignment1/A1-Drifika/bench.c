@@ -0,0 +1,481 @@
+// Strict POSIX keeps <dirent.h>'s DT_* constants from clashing with nqp_dtype.
+#define _POSIX_C_SOURCE 200809L
+
+#include "nqp_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef USE_LIBC_INSTEAD
+#include <dirent.h>
+#include <sys/stat.h>
+#define BACKEND "libc"
+#else
+#define BACKEND "nqp"
+#endif
+
+// bench: time the nqp_io read path on a volume built by mkimage.
+//
+//   bench [-J] [-H] [-r rounds] [-n ops] [-s seed] source
+//
+// source is the image, or with USE_LIBC_INSTEAD the directory that
+// `mkimage -x` wrote the same tree to. Every measurement is repeated
+// `rounds` times and the median is reported, one CSV line (or JSON object
+// with -J) per result. -H leaves out the CSV header so that the nqp and
+// libc runs can be appended to one file.
+
+#define MAX_PATH 512
+#define OPEN_FILES 64 // files kept open for random reads
+#define DIRENT_BATCH 64 // entries per nqp_getdents64 / nqp_getdents_arena call
+
+static const size_t buffer_sizes[] = {512, 4096, 65536, 1048576};
+#define BUFFER_SIZES (sizeof(buffer_sizes) / sizeof(buffer_sizes[0]))
+
+typedef struct
+{
+    char path[MAX_PATH]; // path on the volume, starting with '/'
+    off_t size;
+} bench_file;
+
+static const char *source_root = ""; // prefix for the libc backend
+static bench_file *files = NULL;
+static size_t file_count = 0;
+static size_t file_capacity = 0;
+static char (*dirs)[MAX_PATH] = NULL;
+static size_t dir_count = 0;
+static size_t dir_capacity = 0;
+
+static int json = 0;
+static int results = 0;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *values, int count)
+{
+    qsort(values, count, sizeof(double), compare_double);
+    return values[count / 2];
+}
+
+/**
+ * Print one result line.
+ */
+static void report(const char *test, size_t buffer, size_t ops, double value, const char *unit)
+{
+    if (json)
+    {
+        printf("%s{\"backend\": \"%s\", \"test\": \"%s\", \"buffer\": %zu, \"ops\": %zu, \"value\": %.3f, "
+               "\"unit\": \"%s\"}",
+               results ? ",\n  " : "[\n  ", BACKEND, test, buffer, ops, value, unit);
+    }
+    else
+    {
+        printf("%s,%s,%zu,%zu,%.3f,%s\n", BACKEND, test, buffer, ops, value, unit);
+    }
+    results++;
+}
+
+/**
+ * Open a path on the volume (prefixed with the source directory for libc).
+ */
+static int bench_open(const char *path)
+{
+#ifdef USE_LIBC_INSTEAD
+    char full[MAX_PATH * 2];
+    snprintf(full, sizeof(full), "%s%s", source_root, path);
+    return nqp_open(full);
+#else
+    return nqp_open(path);
+#endif
+}
+
+static void add_file(const char *path, off_t size)
+{
+    if (file_count == file_capacity)
+    {
+        file_capacity = file_capacity ? file_capacity * 2 : 256;
+        files = realloc(files, file_capacity * sizeof(bench_file));
+        if (!files)
+            exit(EXIT_FAILURE);
+    }
+    snprintf(files[file_count].path, MAX_PATH, "%s", path);
+    files[file_count++].size = size;
+}
+
+static void add_dir(const char *path)
+{
+    if (dir_count == dir_capacity)
+    {
+        dir_capacity = dir_capacity ? dir_capacity * 2 : 64;
+        dirs = realloc(dirs, dir_capacity * sizeof(*dirs));
+        if (!dirs)
+            exit(EXIT_FAILURE);
+    }
+    snprintf(dirs[dir_count++], MAX_PATH, "%s", path);
+}
+
+/**
+ * List one directory, returning the number of entries. With `collect` set,
+ * the files and subdirectories found are added to the lists (untimed).
+ */
+static size_t list_directory(const char *path, int collect)
+{
+    size_t entries = 0;
+    char child[MAX_PATH];
+
+#ifdef USE_LIBC_INSTEAD
+    char full[MAX_PATH * 2];
+    snprintf(full, sizeof(full), "%s%s", source_root, path);
+    DIR *dir = opendir(full);
+    if (!dir)
+        return 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        entries++;
+        if (!collect)
+            continue;
+
+        struct stat info;
+        snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path, entry->d_name);
+        snprintf(full, sizeof(full), "%s%s", source_root, child);
+        if (stat(full, &info) != 0)
+            continue;
+        if (S_ISDIR(info.st_mode))
+            add_dir(child);
+        else
+            add_file(child, info.st_size);
+    }
+    closedir(dir);
+#else
+    int fd = nqp_open(path);
+    if (fd < 0)
+        return 0;
+    nqp_dirent entry;
+    while (nqp_getdents(fd, &entry, 1) > 0)
+    {
+        entries++;
+        if (collect)
+        {
+            snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path, entry.name);
+            if (entry.type == DT_DIR)
+            {
+                add_dir(child);
+            }
+            else
+            {
+                int file = nqp_open(child);
+                add_file(child, file >= 0 ? nqp_lseek(file, 0, SEEK_END) : 0);
+                nqp_close(file);
+            }
+        }
+        free(entry.name);
+    }
+    nqp_close(fd);
+#endif
+    return entries;
+}
+
+/**
+ * List one directory without collecting anything (the legacy nqp_getdents,
+ * or readdir for libc).
+ */
+static size_t count_directory(const char *path)
+{
+    return list_directory(path, 0);
+}
+
+#ifndef USE_LIBC_INSTEAD
+/**
+ * List one directory with nqp_getdents64, returning the number of entries.
+ */
+static size_t count_getdents64(const char *path)
+{
+    static uint64_t buffer[DIRENT_BATCH * NQP_DIRENT64_RECLEN(255) / sizeof(uint64_t)];
+    size_t entries = 0;
+    int fd = nqp_open(path);
+    if (fd < 0)
+        return 0;
+    ssize_t got;
+    while ((got = nqp_getdents64(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t offset = 0; offset < got;)
+        {
+            offset += ((nqp_dirent64 *)((char *)buffer + offset))->record_length;
+            entries++;
+        }
+    }
+    nqp_close(fd);
+    return entries;
+}
+
+/**
+ * List one directory with nqp_getdents_arena and a caller-owned arena, so
+ * that nothing is allocated, returning the number of entries.
+ */
+static size_t count_getdents_arena(const char *path)
+{
+    static nqp_dirent batch[DIRENT_BATCH];
+    static char arena[DIRENT_BATCH * 256];
+    size_t entries = 0;
+    int fd = nqp_open(path);
+    if (fd < 0)
+        return 0;
+    ssize_t got;
+    while ((got = nqp_getdents_arena(fd, batch, DIRENT_BATCH, arena, sizeof(arena))) > 0)
+    {
+        entries += got;
+    }
+    nqp_close(fd);
+    return entries;
+}
+#endif
+
+/**
+ * Time opening (and closing) every file, twice: the first pass finds the
+ * paths cold, the second after the first has warmed any lookup caches.
+ */
+static void bench_open_close(int rounds)
+{
+    double *latency = malloc(file_count * sizeof(double));
+    double cold[rounds], hot[rounds], tail[rounds];
+    if (!latency)
+        exit(EXIT_FAILURE);
+
+    for (int round = 0; round < rounds; round++)
+    {
+#ifndef USE_LIBC_INSTEAD
+        // Remount so that every round starts with empty caches.
+        nqp_unmount();
+        nqp_mount(source_root, NQP_FS_EXFAT);
+#endif
+        for (int pass = 0; pass < 2; pass++)
+        {
+            double total = 0;
+            for (size_t i = 0; i < file_count; i++)
+            {
+                double start = now();
+                int fd = bench_open(files[i].path);
+                latency[i] = now() - start;
+                total += latency[i];
+                nqp_close(fd);
+            }
+            if (pass == 0)
+            {
+                cold[round] = total / file_count * 1e9;
+            }
+            else
+            {
+                hot[round] = total / file_count * 1e9;
+                qsort(latency, file_count, sizeof(double), compare_double);
+                tail[round] = latency[file_count * 99 / 100] * 1e9;
+            }
+        }
+    }
+    report("open_cold", 0, file_count, median(cold, rounds), "ns/op");
+    report("open_hot", 0, file_count, median(hot, rounds), "ns/op");
+    report("open_hot_p99", 0, file_count, median(tail, rounds), "ns");
+    free(latency);
+}
+
+/**
+ * Time listing every directory with `list`.
+ */
+static void bench_getdents(int rounds, const char *test, size_t (*list)(const char *path))
+{
+    double rate[rounds];
+    size_t entries = 0;
+    for (int round = 0; round < rounds; round++)
+    {
+        entries = 0;
+        double start = now();
+        for (size_t i = 0; i < dir_count; i++)
+        {
+            entries += list(dirs[i]);
+        }
+        rate[round] = entries / (now() - start);
+    }
+    report(test, 0, entries, median(rate, rounds), "entries/s");
+}
+
+/**
+ * Time reading every file from start to end with `size` byte reads.
+ */
+static void bench_sequential(int rounds, char *buffer, size_t size)
+{
+    double rate[rounds];
+    size_t calls = 0;
+    for (int round = 0; round < rounds; round++)
+    {
+        uint64_t bytes = 0;
+        calls = 0;
+        double start = now();
+        for (size_t i = 0; i < file_count; i++)
+        {
+            int fd = bench_open(files[i].path);
+            ssize_t got;
+            while ((got = nqp_read(fd, buffer, size)) > 0)
+            {
+                bytes += got;
+                calls++;
+            }
+            nqp_close(fd);
+        }
+        rate[round] = bytes / (now() - start) / (1024 * 1024);
+    }
+    report("read_seq", size, calls, median(rate, rounds), "MB/s");
+}
+
+/**
+ * Time `ops` reads of `size` bytes at random offsets in the largest files.
+ */
+static void bench_random(int rounds, char *buffer, size_t size, size_t ops, unsigned seed)
+{
+    int fds[OPEN_FILES];
+    size_t open_count = file_count < OPEN_FILES ? file_count : OPEN_FILES;
+    double rate[rounds];
+
+    // The largest files come first (see main).
+    for (size_t i = 0; i < open_count; i++)
+    {
+        fds[i] = bench_open(files[i].path);
+    }
+
+    for (int round = 0; round < rounds; round++)
+    {
+        unsigned state = seed + round;
+        uint64_t bytes = 0;
+        double start = now();
+        for (size_t op = 0; op < ops; op++)
+        {
+            size_t which = rand_r(&state) % open_count;
+            off_t span = files[which].size > (off_t)size ? files[which].size - (off_t)size : 0;
+            off_t offset = span ? ((off_t)rand_r(&state) * RAND_MAX + rand_r(&state)) % span : 0;
+            nqp_lseek(fds[which], offset, SEEK_SET);
+            ssize_t got = nqp_read(fds[which], buffer, size);
+            if (got > 0)
+                bytes += got;
+        }
+        rate[round] = bytes / (now() - start) / (1024 * 1024);
+    }
+    report("read_rand", size, ops, median(rate, rounds), "MB/s");
+
+    for (size_t i = 0; i < open_count; i++)
+    {
+        nqp_close(fds[i]);
+    }
+}
+
+static int compare_size(const void *a, const void *b)
+{
+    off_t x = ((const bench_file *)a)->size, y = ((const bench_file *)b)->size;
+    return (x < y) - (x > y); // Largest first
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 3;
+    size_t ops = 4096;
+    unsigned seed = 3430;
+    int header = 1;
+    int option;
+
+    while ((option = getopt(argc, argv, "JHr:n:s:")) != -1)
+    {
+        switch (option)
+        {
+        case 'J':
+            json = 1;
+            break;
+        case 'H':
+            header = 0;
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'n':
+            ops = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-J] [-H] [-r rounds] [-n ops] [-s seed] source\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || rounds < 1 || ops < 1)
+    {
+        fprintf(stderr, "Usage: %s [-J] [-H] [-r rounds] [-n ops] [-s seed] source\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    source_root = argv[optind];
+
+    if (nqp_mount(source_root, NQP_FS_EXFAT) != NQP_OK)
+    {
+        fprintf(stderr, "%s: could not mount %s\n", argv[0], source_root);
+        return EXIT_FAILURE;
+    }
+
+    // Find every file and directory (untimed).
+    add_dir("/");
+    for (size_t i = 0; i < dir_count; i++)
+    {
+        list_directory(dirs[i], 1);
+    }
+    if (file_count == 0)
+    {
+        fprintf(stderr, "%s: no files in %s\n", argv[0], source_root);
+        return EXIT_FAILURE;
+    }
+
+    char *buffer = malloc(buffer_sizes[BUFFER_SIZES - 1]);
+    if (!buffer)
+        return EXIT_FAILURE;
+
+    if (header && !json)
+    {
+        printf("backend,test,buffer,ops,value,unit\n");
+    }
+
+    bench_open_close(rounds);
+    bench_getdents(rounds, "getdents", count_directory);
+#ifndef USE_LIBC_INSTEAD
+    bench_getdents(rounds, "getdents64", count_getdents64);
+    bench_getdents(rounds, "getdents_arena", count_getdents_arena);
+#endif
+    for (size_t i = 0; i < BUFFER_SIZES; i++)
+    {
+        bench_sequential(rounds, buffer, buffer_sizes[i]);
+    }
+    qsort(files, file_count, sizeof(bench_file), compare_size);
+    for (size_t i = 0; i < BUFFER_SIZES; i++)
+    {
+        bench_random(rounds, buffer, buffer_sizes[i], ops, seed);
+    }
+
+    if (json)
+    {
+        printf("\n]\n");
+    }
+
+    free(buffer);
+    free(files);
+    free(dirs);
+    (void)nqp_unmount();
+    return EXIT_SUCCESS;
+}
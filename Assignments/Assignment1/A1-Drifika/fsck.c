@@ -0,0 +1,73 @@
+#include "nqp_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+    unsigned threads = 0;
+    int option;
+
+    // Usage: fsck [-j threads] image
+    while ((option = getopt(argc, argv, "j:")) != -1)
+    {
+        switch (option)
+        {
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-j threads] image\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-j threads] image\n", argv[0]);
+        return 2;
+    }
+
+    if (nqp_mount(argv[optind], NQP_FS_EXFAT) != NQP_OK)
+    {
+        fprintf(stderr, "%s: could not mount %s\n", argv[0], argv[optind]);
+        return 2;
+    }
+
+    struct timespec start, end;
+    nqp_fsck_report report;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = nqp_fsck(&report, threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    nqp_unmount();
+
+    if (result < 0)
+    {
+        fprintf(stderr, "%s: check failed\n", argv[0]);
+        return 2;
+    }
+
+    for (size_t i = 0; i < report.message_count; i++)
+    {
+        printf("%s\n", report.messages[i]);
+    }
+    if (report.problems > report.message_count)
+    {
+        printf("... and %zu more\n", report.problems - report.message_count);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %zu files, %zu directories checked in %.3f s\n", argv[optind], report.files, report.directories,
+           seconds);
+    printf("  broken chains:        %zu\n", report.bad_chains);
+    printf("  unallocated clusters: %zu\n", report.unallocated);
+    printf("  cross-linked clusters: %zu\n", report.cross_linked);
+    printf("  wrong sizes:          %zu\n", report.bad_lengths);
+    printf("  bad checksums:        %zu\n", report.bad_checksums);
+    printf("  bad entry sets:       %zu\n", report.bad_entries);
+    printf("  lost clusters:        %zu\n", report.lost_clusters);
+    printf("  unreadable:           %zu\n", report.unreadable);
+    printf("%s\n", report.problems == 0 ? "clean" : "PROBLEMS FOUND");
+
+    return report.problems == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,640 @@
+/*
+ * mkimage: build a synthetic exFAT volume for exercising the nqp_io read path.
+ *
+ * The volume is laid out as:
+ *   sector 0              main boot record
+ *   fat_offset            one FAT
+ *   cluster_heap_offset   allocation bitmap, up-case table, then directories
+ *                         and file data
+ *
+ * Every directory gets `files` regular files and `fanout` subdirectories, down
+ * to `depth` levels. File data is allocated in order unless a fragmentation
+ * percentage is given, in which case that share of file clusters is swapped
+ * with a random other data cluster (or free cluster) so chains jump around
+ * the heap. Free space can be added after the data; fragmentation scatters
+ * it between the files too.
+ *
+ * File contents are text lines of the form "<name> line <n>\n" so that the
+ * same images are useful for the shell (cat/grep/sort) as well as for timing.
+ *
+ * With -x the same tree is also written to a directory on the host, so that
+ * bench can time the libc baseline (USE_LIBC_INSTEAD) on identical files.
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nqp_exfat_types.h"
+
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define NAME_CHARS_PER_ENTRY 15
+#define FAT_EOC 0xFFFFFFFF
+
+// 2025-01-15 12:00:00 in the exFAT (DOS) timestamp format
+#define FIXED_TIMESTAMP ((45u << 25) | (1u << 21) | (15u << 16) | (12u << 11))
+
+typedef struct NODE
+{
+    char name[256];
+    int is_dir;
+    uint64_t size;      // data_length in bytes
+    uint32_t clusters;  // number of clusters allocated
+    uint32_t *chain;    // allocated clusters, in file order
+    struct NODE **kids; // children (directories only)
+    int nkids;
+    int index;        // position among siblings, used for file contents
+    int no_fat_chain; // stream extension NoFatChain flag
+} node;
+
+typedef struct OPTIONS
+{
+    const char *path;
+    const char *extract; // host directory to write the tree to, or NULL
+    uint8_t sector_shift;
+    uint8_t cluster_shift;
+    int files;
+    int fanout;
+    int depth;
+    uint64_t file_size;
+    int frag_percent;
+    int free_percent;
+    int no_fat_chain;
+    int long_names;
+    unsigned seed;
+} options;
+
+static options opts = {
+    .path = NULL,
+    .extract = NULL,
+    .sector_shift = 9,
+    .cluster_shift = 3,
+    .files = 8,
+    .fanout = 2,
+    .depth = 1,
+    .file_size = 64 * 1024,
+    .frag_percent = 0,
+    .free_percent = 0,
+    .no_fat_chain = 0,
+    .long_names = 0,
+    .seed = 3430,
+};
+
+static uint32_t cluster_size;
+static uint32_t next_free = 2;
+static uint32_t *fat;
+static uint32_t fat_entries;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] image\n"
+            "  -s shift   bytes per sector shift (default 9)\n"
+            "  -c shift   sectors per cluster shift (default 3)\n"
+            "  -n files   regular files per directory (default 8)\n"
+            "  -d fanout  subdirectories per directory (default 2)\n"
+            "  -l depth   directory levels below the root (default 1)\n"
+            "  -b bytes   size of every regular file (default 65536)\n"
+            "  -f pct     percentage of file clusters to scatter (default 0)\n"
+            "  -e pct     free space to add, as a percentage of the data (default 0)\n"
+            "  -N         mark unfragmented files and directories NoFatChain\n"
+            "  -L         use names longer than one FILE_NAME entry\n"
+            "  -r seed    random seed for fragmentation (default 3430)\n"
+            "  -x dir     also write the tree to host directory dir\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t entries_for_name(const char *name)
+{
+    return 2 + (strlen(name) + NAME_CHARS_PER_ENTRY - 1) / NAME_CHARS_PER_ENTRY;
+}
+
+static uint32_t clusters_for(uint64_t bytes)
+{
+    return (bytes + cluster_size - 1) / cluster_size;
+}
+
+/*
+ * Build the in-memory tree. Directories are sized after their children are
+ * known; names alternate case so that case-insensitive lookup can be tested.
+ */
+static node *build_tree(const char *name, int level, int index)
+{
+    node *n = calloc(1, sizeof(node));
+    assert(n != NULL);
+    snprintf(n->name, sizeof(n->name), "%s", name);
+    n->is_dir = 1;
+    n->index = index;
+
+    int subdirs = level < opts.depth ? opts.fanout : 0;
+    n->nkids = opts.files + subdirs;
+    n->kids = calloc(n->nkids ? n->nkids : 1, sizeof(node *));
+    assert(n->kids != NULL);
+
+    uint32_t dentries = level == 0 ? 4 : 1; // bitmap, up-case, label; end marker
+    for (int i = 0; i < opts.files; i++)
+    {
+        node *f = calloc(1, sizeof(node));
+        assert(f != NULL);
+        if (opts.long_names)
+            snprintf(f->name, sizeof(f->name), "File-With-A-Rather-Long-Name-%04d.txt", i);
+        else
+            snprintf(f->name, sizeof(f->name), "File%04d.txt", i);
+        f->size = opts.file_size;
+        f->clusters = clusters_for(f->size);
+        f->index = i;
+        n->kids[i] = f;
+        dentries += entries_for_name(f->name);
+    }
+    for (int i = 0; i < subdirs; i++)
+    {
+        char dname[64];
+        snprintf(dname, sizeof(dname), "Dir%02d", i);
+        node *d = build_tree(dname, level + 1, i);
+        n->kids[opts.files + i] = d;
+        dentries += entries_for_name(d->name);
+    }
+
+    n->size = (uint64_t)clusters_for((uint64_t)dentries * sizeof(directory_entry)) * cluster_size;
+    n->clusters = clusters_for(n->size);
+    return n;
+}
+
+static uint64_t count_clusters(node *n)
+{
+    uint64_t total = n->clusters;
+    if (n->is_dir)
+        for (int i = 0; i < n->nkids; i++)
+            total += count_clusters(n->kids[i]);
+    return total;
+}
+
+static void allocate_contiguous(node *n)
+{
+    n->chain = malloc(sizeof(uint32_t) * (n->clusters ? n->clusters : 1));
+    assert(n->chain != NULL);
+    for (uint32_t i = 0; i < n->clusters; i++)
+        n->chain[i] = next_free++;
+}
+
+static void allocate_dirs(node *n)
+{
+    allocate_contiguous(n);
+    for (int i = 0; i < n->nkids; i++)
+        if (n->kids[i]->is_dir)
+            allocate_dirs(n->kids[i]);
+}
+
+static void allocate_files(node *n)
+{
+    for (int i = 0; i < n->nkids; i++)
+    {
+        if (n->kids[i]->is_dir)
+            allocate_files(n->kids[i]);
+        else
+            allocate_contiguous(n->kids[i]);
+    }
+}
+
+// Collect pointers to every file cluster slot so they can be shuffled.
+static void collect_slots(node *n, uint32_t ***slots, size_t *count)
+{
+    for (int i = 0; i < n->nkids; i++)
+    {
+        node *k = n->kids[i];
+        if (k->is_dir)
+            collect_slots(k, slots, count);
+        else
+            for (uint32_t c = 0; c < k->clusters; c++)
+                (*slots)[(*count)++] = &k->chain[c];
+    }
+}
+
+static int is_contiguous(const node *n)
+{
+    for (uint32_t i = 1; i < n->clusters; i++)
+        if (n->chain[i] != n->chain[i - 1] + 1)
+            return 0;
+    return 1;
+}
+
+// Mark a node's clusters, and those of everything under it, in the bitmap.
+static void mark_allocated(const node *n, uint8_t *bits)
+{
+    for (uint32_t i = 0; i < n->clusters; i++)
+        bits[(n->chain[i] - 2) / 8] |= 1u << ((n->chain[i] - 2) % 8);
+    if (n->is_dir)
+        for (int i = 0; i < n->nkids; i++)
+            mark_allocated(n->kids[i], bits);
+}
+
+static void link_chain(const node *n, int no_fat_chain)
+{
+    if (no_fat_chain)
+        return;
+    for (uint32_t i = 0; i < n->clusters; i++)
+        fat[n->chain[i]] = i + 1 < n->clusters ? n->chain[i + 1] : FAT_EOC;
+}
+
+static uint16_t upcase_char(uint16_t c, const uint16_t *table)
+{
+    return table[c];
+}
+
+static uint16_t name_hash(const char *name, const uint16_t *upcase)
+{
+    uint16_t hash = 0;
+    for (size_t i = 0; name[i] != '\0'; i++)
+    {
+        uint16_t c = upcase_char((uint8_t)name[i], upcase);
+        uint8_t bytes[2] = {c & 0xFF, c >> 8};
+        for (int b = 0; b < 2; b++)
+            hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + bytes[b];
+    }
+    return hash;
+}
+
+static uint16_t set_checksum(const directory_entry *set, int entries)
+{
+    const uint8_t *bytes = (const uint8_t *)set;
+    uint16_t sum = 0;
+    for (int i = 0; i < entries * (int)sizeof(directory_entry); i++)
+    {
+        if (i == 2 || i == 3)
+            continue;
+        sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + bytes[i];
+    }
+    return sum;
+}
+
+static void write_at(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    if (pwrite(fd, buf, len, offset) != (ssize_t)len)
+    {
+        perror("pwrite");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static uint64_t cluster_address(uint32_t cluster, uint32_t heap_offset)
+{
+    return ((uint64_t)heap_offset << opts.sector_shift) + (uint64_t)(cluster - 2) * cluster_size;
+}
+
+// Write a buffer that spans a node's clusters, cluster by cluster.
+static void write_node_data(int fd, const node *n, const uint8_t *data, uint32_t heap_offset)
+{
+    for (uint32_t i = 0; i < n->clusters; i++)
+        write_at(fd, data + (uint64_t)i * cluster_size, cluster_size, cluster_address(n->chain[i], heap_offset));
+}
+
+static void fill_file(uint8_t *data, const node *f)
+{
+    uint64_t pos = 0;
+    int line = 0;
+    char text[128];
+    while (pos < f->size)
+    {
+        int len = snprintf(text, sizeof(text), "%s line %d\n", f->name, line++);
+        for (int i = 0; i < len && pos < f->size; i++)
+            data[pos++] = text[i];
+    }
+}
+
+static int add_entry_set(directory_entry *entries, node *k, const uint16_t *upcase)
+{
+    int names = (strlen(k->name) + NAME_CHARS_PER_ENTRY - 1) / NAME_CHARS_PER_ENTRY;
+    int nset = 2 + names;
+    memset(entries, 0, nset * sizeof(directory_entry));
+
+    entries[0].entry_type = DENTRY_TYPE_FILE;
+    entries[0].file.secondary_count = nset - 1;
+    entries[0].file.file_attributes = k->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+    entries[0].file.create_timestamp = FIXED_TIMESTAMP;
+    entries[0].file.last_modified_timestamp = FIXED_TIMESTAMP;
+    entries[0].file.last_accessed_timestamp = FIXED_TIMESTAMP;
+
+    int no_fat_chain = opts.no_fat_chain && is_contiguous(k);
+    k->no_fat_chain = no_fat_chain;
+    entries[1].entry_type = DENTRY_TYPE_STREAM_EXTENSION;
+    entries[1].stream_extension.flags.allocation_possible = 1;
+    entries[1].stream_extension.flags.no_fat_chain = no_fat_chain;
+    entries[1].stream_extension.name_length = strlen(k->name);
+    entries[1].stream_extension.name_hash = name_hash(k->name, upcase);
+    entries[1].stream_extension.valid_data_length = k->size;
+    entries[1].stream_extension.data_length = k->size;
+    entries[1].stream_extension.first_cluster = k->clusters ? k->chain[0] : 0;
+
+    size_t len = strlen(k->name);
+    for (int e = 0; e < names; e++)
+    {
+        entries[2 + e].entry_type = DENTRY_TYPE_FILE_NAME;
+        for (int c = 0; c < NAME_CHARS_PER_ENTRY; c++)
+        {
+            size_t pos = (size_t)e * NAME_CHARS_PER_ENTRY + c;
+            entries[2 + e].file_name.file_name[c] = pos < len ? (uint8_t)k->name[pos] : 0;
+        }
+    }
+    entries[0].file.set_checksum = set_checksum(entries, nset);
+
+    link_chain(k, no_fat_chain);
+    return nset;
+}
+
+static void write_tree(int fd, node *n, uint32_t heap_offset, const uint16_t *upcase,
+                       const directory_entry *root_prefix, int prefix_count)
+{
+    directory_entry *entries = calloc(1, n->size);
+    assert(entries != NULL);
+    int used = 0;
+    if (prefix_count > 0)
+    {
+        memcpy(entries, root_prefix, prefix_count * sizeof(directory_entry));
+        used = prefix_count;
+    }
+
+    for (int i = 0; i < n->nkids; i++)
+    {
+        node *k = n->kids[i];
+        used += add_entry_set(&entries[used], k, upcase);
+        if (k->is_dir)
+        {
+            write_tree(fd, k, heap_offset, upcase, NULL, 0);
+        }
+        else if (k->clusters > 0)
+        {
+            uint8_t *data = calloc(k->clusters, cluster_size);
+            assert(data != NULL);
+            fill_file(data, k);
+            write_node_data(fd, k, data, heap_offset);
+            free(data);
+        }
+    }
+
+    link_chain(n, n->no_fat_chain);
+    write_node_data(fd, n, (uint8_t *)entries, heap_offset);
+    free(entries);
+}
+
+/*
+ * Build the compressed up-case table: identity runs are encoded as 0xFFFF
+ * followed by the run length. ASCII a-z and Latin-1 lower case letters are
+ * mapped to upper case.
+ */
+static size_t build_upcase(uint16_t *compressed, uint16_t *full)
+{
+    size_t n = 0;
+    for (uint32_t c = 0; c < 0x10000; c++)
+        full[c] = c;
+    for (uint32_t c = 'a'; c <= 'z'; c++)
+        full[c] = c - 0x20;
+    for (uint32_t c = 0xE0; c <= 0xFE; c++)
+        if (c != 0xF7)
+            full[c] = c - 0x20;
+    full[0xFF] = 0x178;
+
+    uint32_t c = 0;
+    while (c < 0x10000)
+    {
+        uint32_t run = 0;
+        while (c + run < 0x10000 && full[c + run] == c + run)
+            run++;
+        if (run > 2)
+        {
+            compressed[n++] = 0xFFFF;
+            compressed[n++] = run;
+            c += run;
+        }
+        else
+        {
+            compressed[n++] = full[c++];
+        }
+    }
+    return n;
+}
+
+static uint32_t table_checksum(const uint8_t *bytes, size_t len)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + bytes[i];
+    return sum;
+}
+
+// Write the tree under `n` to the host directory `dir` (see -x).
+static void extract_tree(const node *n, const char *dir)
+{
+    if (mkdir(dir, 0755) != 0 && access(dir, F_OK) != 0)
+    {
+        perror(dir);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n->nkids; i++)
+    {
+        const node *k = n->kids[i];
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, k->name);
+        if (k->is_dir)
+        {
+            extract_tree(k, path);
+            continue;
+        }
+
+        uint8_t *data = calloc(1, k->size ? k->size : 1);
+        assert(data != NULL);
+        fill_file(data, k);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        write_at(fd, data, k->size, 0);
+        close(fd);
+        free(data);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:n:d:l:b:f:e:NLr:x:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': opts.sector_shift = atoi(optarg); break;
+        case 'c': opts.cluster_shift = atoi(optarg); break;
+        case 'n': opts.files = atoi(optarg); break;
+        case 'd': opts.fanout = atoi(optarg); break;
+        case 'l': opts.depth = atoi(optarg); break;
+        case 'b': opts.file_size = strtoull(optarg, NULL, 10); break;
+        case 'f': opts.frag_percent = atoi(optarg); break;
+        case 'e': opts.free_percent = atoi(optarg); break;
+        case 'N': opts.no_fat_chain = 1; break;
+        case 'L': opts.long_names = 1; break;
+        case 'r': opts.seed = strtoul(optarg, NULL, 10); break;
+        case 'x': opts.extract = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || opts.sector_shift < 9 || opts.sector_shift > 12 ||
+        opts.cluster_shift > 25 - opts.sector_shift)
+        usage(argv[0]);
+    opts.path = argv[optind];
+    cluster_size = 1u << (opts.sector_shift + opts.cluster_shift);
+    srand(opts.seed);
+
+    static uint16_t upcase_full[0x10000];
+    static uint16_t upcase_table[0x10000];
+    size_t upcase_len = build_upcase(upcase_table, upcase_full) * sizeof(uint16_t);
+
+    node *root = build_tree("", 0, 0);
+    uint64_t data_clusters = count_clusters(root);
+
+    // The bitmap and up-case table live at the start of the heap.
+    uint32_t upcase_clusters = clusters_for(upcase_len);
+    uint64_t free_clusters = data_clusters * opts.free_percent / 100;
+    uint32_t cluster_count = data_clusters + free_clusters + upcase_clusters + 1;
+    uint32_t bitmap_bytes = (cluster_count + 7) / 8;
+    uint32_t bitmap_clusters = clusters_for(bitmap_bytes);
+    cluster_count += bitmap_clusters - 1;
+    bitmap_bytes = (cluster_count + 7) / 8;
+
+    uint32_t sector = 1u << opts.sector_shift;
+    uint32_t fat_offset = 24;
+    fat_entries = cluster_count + 2;
+    uint32_t fat_length = ((uint64_t)fat_entries * 4 + sector - 1) / sector;
+    uint32_t spc = 1u << opts.cluster_shift;
+    uint32_t heap_offset = ((fat_offset + fat_length + spc - 1) / spc) * spc;
+    uint64_t volume_sectors = heap_offset + (uint64_t)cluster_count * spc;
+
+    fat = calloc(fat_entries, sizeof(uint32_t));
+    assert(fat != NULL);
+    fat[0] = 0xFFFFFFF8;
+    fat[1] = FAT_EOC;
+
+    node bitmap = {.clusters = bitmap_clusters};
+    node upcase = {.clusters = upcase_clusters};
+    allocate_contiguous(&bitmap);
+    allocate_contiguous(&upcase);
+    allocate_dirs(root);
+    allocate_files(root);
+
+    if (opts.frag_percent > 0)
+    {
+        // Free clusters take part in the shuffle, so holes end up between
+        // (and inside) files rather than all at the end of the heap.
+        size_t nslots = 0;
+        uint32_t **slots = malloc(sizeof(uint32_t *) * (data_clusters + free_clusters + 1));
+        uint32_t *spare = malloc(sizeof(uint32_t) * (free_clusters + 1));
+        assert(slots != NULL && spare != NULL);
+        collect_slots(root, &slots, &nslots);
+        size_t nfiles = nslots;
+        for (uint64_t i = 0; i < free_clusters; i++)
+        {
+            spare[i] = next_free + i;
+            slots[nslots++] = &spare[i];
+        }
+        for (size_t i = 0; i < nfiles; i++)
+        {
+            if (rand() % 100 < opts.frag_percent)
+            {
+                size_t j = (size_t)rand() % nslots;
+                uint32_t tmp = *slots[i];
+                *slots[i] = *slots[j];
+                *slots[j] = tmp;
+            }
+        }
+        free(slots);
+        free(spare);
+    }
+
+    int fd = open(opts.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(opts.path);
+        return EXIT_FAILURE;
+    }
+    if (ftruncate(fd, (off_t)(volume_sectors << opts.sector_shift)) != 0)
+    {
+        perror("ftruncate");
+        return EXIT_FAILURE;
+    }
+
+    main_boot_record mbr;
+    memset(&mbr, 0, sizeof(mbr));
+    mbr.jump_boot[0] = 0xEB;
+    mbr.jump_boot[1] = 0x76;
+    mbr.jump_boot[2] = 0x90;
+    memcpy(mbr.fs_name, "EXFAT   ", 8);
+    mbr.volume_length = volume_sectors;
+    mbr.fat_offset = fat_offset;
+    mbr.fat_length = fat_length;
+    mbr.cluster_heap_offset = heap_offset;
+    mbr.cluster_count = cluster_count;
+    mbr.first_cluster_of_root_directory = root->chain[0];
+    mbr.volume_serial_number = opts.seed;
+    mbr.fs_revision = 0x0100;
+    mbr.bytes_per_sector_shift = opts.sector_shift;
+    mbr.sectors_per_cluster_shift = opts.cluster_shift;
+    mbr.number_of_fats = 1;
+    mbr.drive_select = 0x80;
+    mbr.boot_signature = 0xAA55;
+    write_at(fd, &mbr, sizeof(mbr), 0);
+
+    // Allocation bitmap: every cluster that ended up in a chain is in use.
+    uint8_t *bits = calloc(bitmap_clusters, cluster_size);
+    assert(bits != NULL);
+    mark_allocated(&bitmap, bits);
+    mark_allocated(&upcase, bits);
+    mark_allocated(root, bits);
+    link_chain(&bitmap, 0);
+    write_node_data(fd, &bitmap, bits, heap_offset);
+    free(bits);
+
+    uint8_t *table = calloc(upcase_clusters, cluster_size);
+    assert(table != NULL);
+    memcpy(table, upcase_table, upcase_len);
+    link_chain(&upcase, 0);
+    write_node_data(fd, &upcase, table, heap_offset);
+    free(table);
+
+    directory_entry prefix[3];
+    memset(prefix, 0, sizeof(prefix));
+    prefix[0].entry_type = DENTRY_TYPE_VOLUME_LABEL;
+    prefix[0].label.character_count = 4;
+    const char *label = "NQPB";
+    for (int i = 0; i < 4; i++)
+        prefix[0].label.volume_label[i] = label[i];
+    prefix[1].entry_type = DENTRY_TYPE_ALLOCATION_BITMAP;
+    prefix[1].bitmap.first_cluster = bitmap.chain[0];
+    prefix[1].bitmap.data_length = bitmap_bytes;
+    prefix[2].entry_type = DENTRY_TYPE_UP_CASE_TABLE;
+    uint8_t *raw = (uint8_t *)&prefix[2];
+    uint32_t checksum = table_checksum((const uint8_t *)upcase_table, upcase_len);
+    uint32_t first = upcase.chain[0];
+    uint64_t length = upcase_len;
+    memcpy(raw + 4, &checksum, sizeof(checksum));
+    memcpy(raw + 20, &first, sizeof(first));
+    memcpy(raw + 24, &length, sizeof(length));
+
+    write_tree(fd, root, heap_offset, upcase_full, prefix, 3);
+
+    write_at(fd, fat, (size_t)fat_entries * sizeof(uint32_t), (uint64_t)fat_offset << opts.sector_shift);
+    close(fd);
+
+    if (opts.extract)
+        extract_tree(root, opts.extract);
+
+    printf("%s: %u clusters of %u bytes, %llu used\n", opts.path, cluster_count, cluster_size,
+           (unsigned long long)(cluster_count - free_clusters));
+    return EXIT_SUCCESS;
+}
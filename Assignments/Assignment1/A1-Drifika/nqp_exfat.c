@@ -3,653 +3,3434 @@
 #include <stdio.h>
 #include <string.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "nqp_io.h"
 #include "nqp_exfat_types.h"
 
-// Global state for the mounted file system
-static FILE *fs_image = NULL; // File pointer for the file system image
+// Global state for the mounted file system. It is set up by nqp_mount and
+// torn down by nqp_unmount and is read-only in between, so every other call
+// can run from many threads at once.
+static int fs_fd = -1;       // File descriptor for the file system image (read with pread)
 static int is_mounted = 0;    // Flag to indicate if the FS is mounted
 static main_boot_record mbr;  // Stores the Main Boot Record data
 
+// Mapped backend (NQP_MOUNT_MMAP): the whole image is mapped read-only and
+// device reads become memcpy, directory clusters are parsed in place.
+static const uint8_t *fs_map = NULL;
+static size_t fs_map_size = 0;
+
+// Mappings at least this large get access pattern hints: random for the
+// mapping as a whole (directory lookups hop around the heap) and an explicit
+// read-ahead for long file runs.
+#define MMAP_ADVISE_THRESHOLD (64u * 1024 * 1024)
+#define MMAP_WILLNEED_RUN (256u * 1024)
+
+// Read-ahead window for sequential nqp_read streams: starts at the minimum,
+// doubles every time more is issued and drops to zero on a seek.
+#define READAHEAD_MIN (128u * 1024)
+#define READAHEAD_MAX (2u * 1024 * 1024)
+
+// In-memory copy of the FAT, loaded once at mount time so that walking a
+// cluster chain is an array lookup instead of a device read per hop.
+static uint32_t *fat_cache = NULL;
+static uint32_t fat_entries = 0; // cluster_count + 2 (clusters 0 and 1 are reserved)
+
+// The volume's up-case table, expanded to one entry per UTF-16 code unit.
+// File name hashes are computed over the up-cased name.
+static uint16_t *up_case = NULL;
+
+// The allocation bitmap, one bit per cluster of the heap (bit n of word
+// n / 64 is cluster n + 2), with the bits past the last cluster cleared.
+// The volume is read-only, so the free space figures are worked out once at
+// mount. NULL if the volume has no bitmap.
+static uint64_t *alloc_bitmap = NULL;
+static size_t alloc_bitmap_words = 0;
+static nqp_statfs_info volume_stats;
+
+// Cluster cache for the pread backend: recently read clusters, keyed by
+// cluster number, shared by every descriptor. Directory clusters (nqp_open,
+// nqp_getdents) and reads that only need part of a cluster go through it, so
+// repeated lookups, listings and small-buffer reads of the same files are
+// served from memory. Reads covering whole clusters bypass it: they are
+// already one pread straight into the caller's buffer and would only push
+// directory clusters out. Eviction is CLOCK (second chance). Sized by
+// nqp_set_cache_size before mounting; the mapped backend doesn't use it.
 typedef struct
 {
-    int in_use;
+    uint32_t cluster;   // 0 when the slot is empty (no heap cluster is 0)
+    uint8_t referenced; // CLOCK bit, set on every hit
+    int32_t hash_next;  // next slot in the same bucket, -1 ends the chain
+} cache_slot;
+
+static size_t cache_clusters_wanted = NQP_CACHE_DEFAULT_CLUSTERS;
+static size_t cache_capacity = 0; // slots; 0 when the cache is off
+static cache_slot *cache_slots = NULL;
+static uint8_t *cache_data = NULL; // cache_capacity clusters, slot i at i * cluster size
+static int32_t *cache_buckets = NULL;
+static uint32_t cache_bucket_mask = 0;
+static size_t cache_hand = 0; // CLOCK hand
+static uint64_t cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Upper bound on the memory the cache may take, whatever the cluster size.
+#define CACHE_MAX_BYTES (64u * 1024 * 1024)
+
+// Read path counters for nqp_stats. Any thread bumps them with a relaxed
+// atomic add and nqp_stats swaps them for zero, so they need no lock. With
+// -DNQP_NO_STATS the counting and call timing compile away.
+static nqp_stats_info stats_counters;
+static int stats_timing = 0; // NQP_MOUNT_TIMING: fill in the latency histograms
+
+#ifdef NQP_NO_STATS
+#define STAT_ADD(field, n) ((void)0)
+#else
+#define STAT_ADD(field, n) ((void)__atomic_add_fetch(&stats_counters.field, (n), __ATOMIC_RELAXED))
+#endif
+
+// Open file table slot states. A slot is taken off the free list as
+// SLOT_CLAIMED, filled in, then published as SLOT_OPEN.
+#define SLOT_FREE 0
+#define SLOT_CLAIMED 1 // being filled in by nqp_open
+#define SLOT_OPEN 2
+
+// Most buffers nqp_preadv takes in one call, as preadv(2) (glibc only
+// defines IOV_MAX for X/Open builds).
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// A position in a file's cluster chain.
+typedef struct
+{
+    uint32_t cluster; // cluster number holding logical cluster `index`
+    uint32_t index;   // logical cluster index (offset / cluster size)
+} chain_cursor;
+
+// Where a file's data lives. It doesn't change while the file is open, so a
+// copy can be read from without holding the descriptor's lock.
+typedef struct
+{
+    uint32_t start_cluster;
+    uint64_t size;
+    int no_fat_chain;
+} file_extent;
+
+// One entry per descriptor (see fd_entry for the descriptor to entry mapping).
+typedef struct
+{
+    int state;            // SLOT_*, only accessed atomically
+    pthread_mutex_t lock; // serialises calls on this descriptor
     uint32_t start_cluster;
     uint64_t file_size; // valid_data_length
     uint64_t offset;    // current offset in the file
+
+    // Cached position in the cluster chain, so sequential reads continue from
+    // where the last one stopped instead of re-walking from start_cluster.
+    // nqp_getdents uses the same cursor as its position in the directory.
+    chain_cursor cursor;
+    size_t dir_entry;       // nqp_getdents: next directory_entry within cursor.cluster
+    chain_cursor pread_hint; // where the last nqp_pread on this descriptor ended
+
+    // A cluster sized buffer for the pread backend, allocated on first use.
+    // Directories keep the cluster under the getdents cursor in it, so a
+    // listing reads each cluster once; files use it to fill the cluster
+    // cache on partial reads, and a sequential reader keeps its current
+    // cluster in it instead of in the shared cache (see partial_cluster_read).
+    uint8_t *cluster_buffer;
+    uint32_t buffered_cluster; // cluster held in cluster_buffer, or 0
+
+    // nqp_getdents_arena without a caller arena: names of the last batch.
+    char *name_arena;
+
+    // Read-ahead state for sequential readers (see file_readahead).
+    uint64_t ra_next_offset; // where the next read starts if access is sequential
+    uint64_t ra_until;       // read-ahead has been issued up to this offset
+    uint32_t ra_window;      // bytes to keep in flight; 0 while not sequential
+
+    int no_fat_chain; // NoFatChain flag: data is one contiguous run, FAT not valid
+    int is_directory;
+    int next_free; // next descriptor on the free list while SLOT_FREE
 } open_file_entry;
 
-#define MAX_OPEN_FILES 8
-open_file_entry open_files[MAX_OPEN_FILES];
+// The open file table grows a chunk of descriptors at a time. Chunks never
+// move once allocated (another thread may be holding an entry's lock), so a
+// descriptor is found with two array lookups. Free descriptors are kept on a
+// free list, most recently closed first.
+#define FD_CHUNK_SHIFT 6
+#define FD_CHUNK_SIZE (1 << FD_CHUNK_SHIFT) // descriptors per chunk
+#define FD_MAX_CHUNKS 1024                  // so at most 65536 open files
+
+static open_file_entry *fd_chunks[FD_MAX_CHUNKS];
+static int fd_chunk_count = 0; // chunks in use, read atomically
+static int fd_free_head = -1;  // first free descriptor, -1 if none
+static pthread_mutex_t fd_table_lock = PTHREAD_MUTEX_INITIALIZER; // free list and growth
+
+// Size of the per-descriptor name arena used by nqp_getdents_arena when the
+// caller doesn't pass one. Enough for a few hundred typical names per call.
+#define NAME_ARENA_SIZE (16 * 1024)
+
+/**
+ * Start timing a call for nqp_stats.
+ * Return: the monotonic clock in nanoseconds, or 0 if calls aren't being
+ *         timed.
+ */
+static uint64_t stats_clock(void)
+{
+#ifdef NQP_NO_STATS
+    return 0;
+#else
+    if (!stats_timing)
+        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/**
+ * Count a call that started at `start` (from stats_clock), adding it to the
+ * latency histogram if it was timed.
+ */
+static void stats_latency(nqp_latency *latency, uint64_t start)
+{
+#ifdef NQP_NO_STATS
+    (void)latency;
+    (void)start;
+#else
+    __atomic_add_fetch(&latency->calls, 1, __ATOMIC_RELAXED);
+    if (start == 0)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec - start;
+    int bucket = 0;
+    if (elapsed >= 256)
+    {
+        bucket = 63 - __builtin_clzll(elapsed) - 7; // 2^(bucket+7) <= elapsed < 2^(bucket+8)
+        if (bucket >= NQP_LATENCY_BUCKETS)
+            bucket = NQP_LATENCY_BUCKETS - 1;
+    }
+    __atomic_add_fetch(&latency->timed_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&latency->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&latency->buckets[bucket], 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/**
+ * Encode `count` UTF-16 code units as UTF-8 in one pass.
+ *
+ * Names are nearly always plain ASCII, so the whole name is checked for
+ * that first and then narrowed; both loops are branch-free over the data,
+ * so the compiler can vectorise them (gcc does at -O3). Otherwise each
+ * unit is encoded in turn. A surrogate that isn't part of a pair is encoded
+ * as if it were a character (as WTF-8 does), so every stored name decodes
+ * to a distinct string that nqp_open maps back to the same code units.
+ *
+ * Parameters:
+ *  * out: Room for 3 * count + 1 bytes.
+ * Return: the length of the encoded name; out is NUL-terminated.
+ */
+static size_t utf16_to_utf8(const uint16_t *restrict units, size_t count, char *restrict out)
+{
+    uint16_t any = 0;
+    for (size_t i = 0; i < count; i++)
+        any |= units[i];
+    if (any < 0x80)
+    {
+        for (size_t i = 0; i < count; i++)
+            out[i] = (char)units[i];
+        out[count] = '\0';
+        return count;
+    }
+
+    uint8_t *dst = (uint8_t *)out;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t c = units[i];
+        if (c < 0x80)
+        {
+            *dst++ = c;
+            continue;
+        }
+        if (c < 0x800)
+        {
+            *dst++ = 0xC0 | (c >> 6);
+            *dst++ = 0x80 | (c & 0x3F);
+            continue;
+        }
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < count && units[i + 1] >= 0xDC00 && units[i + 1] < 0xE000)
+        {
+            c = 0x10000 + ((c - 0xD800) << 10) + (units[++i] - 0xDC00);
+            *dst++ = 0xF0 | (c >> 18);
+            *dst++ = 0x80 | ((c >> 12) & 0x3F);
+        }
+        else
+        {
+            *dst++ = 0xE0 | (c >> 12);
+        }
+        *dst++ = 0x80 | ((c >> 6) & 0x3F);
+        *dst++ = 0x80 | (c & 0x3F);
+    }
+    *dst = '\0';
+    return dst - (uint8_t *)out;
+}
 
 /**
- * Convert a Unicode-formatted string containing only ASCII characters
- * into a regular ASCII-formatted string (16-bit chars to 8-bit chars).
+ * Convert a UTF-16 string (such as a file name from a FILE_NAME entry) into
+ * a newly allocated UTF-8 string. The caller frees it.
  */
-char *unicode2ascii(uint16_t *unicode_string, uint8_t length)
+char *unicode2ascii(const uint16_t *unicode_string, uint8_t length)
 {
     assert(unicode_string != NULL);
     assert(length > 0);
 
-    char *ascii_string = calloc(length + 1, sizeof(char)); // Allocate memory for ASCII string
+    STAT_ADD(name_conversions, 1);
+    STAT_ADD(name_allocations, 1);
+    char *ascii_string = malloc((size_t)length * 3 + 1); // Every code unit takes at most 3 bytes
     if (ascii_string)
     {
-        for (uint8_t i = 0; i < length; i++)
-        {
-            ascii_string[i] = (char)(unicode_string[i] & 0xFF); // Strip the top 8 bits
-        }
-        ascii_string[length] = '\0'; // Null-terminate the string
+        utf16_to_utf8(unicode_string, length, ascii_string);
     }
     return ascii_string;
 }
 
 /**
- * Mount the file system.
- *  What Does nqp_mount Need to Do?
- * 1. Open the file system image (a binary file representing an exFAT-formatted disk).
- * 2. Read the Main Boot Record (MBR) from the first sector.
- * 3. Validate the following fields:
- *       File System Name (fs_name): Must be "EXFAT".
-         MustBeZero (must_be_zero): Must be all zero bytes.
-         First Cluster of Root Directory (first_cluster_of_root_directory): Must be ≥ 2 (since cluster numbers start at 2).
+ * Read `length` bytes at byte `address` of the image into `buffer`.
+ *
+ * Uses pread so there is no shared file position to seek, and retries short
+ * reads so callers can ask for many clusters at once.
+ * Return: 0 on success, -1 on error or if the image ends first.
+ */
+static int device_read(void *buffer, size_t length, uint64_t address)
+{
+    STAT_ADD(device_reads, 1);
+    STAT_ADD(device_read_bytes, length);
+    if (fs_map)
+    {
+        if (address > fs_map_size || length > fs_map_size - address)
+        {
+            return -1;
+        }
+        memcpy(buffer, fs_map + address, length);
+        return 0;
+    }
 
-   4. Perform additional sanity checks :
-       Ensure the Boot Signature (boot_signature) is 0xAA55.
-       Ensure the volume size is reasonable.
-       Ensure the FAT Table is properly located.
+    uint8_t *dest = buffer;
+    while (length > 0)
+    {
+        ssize_t got = pread(fs_fd, dest, length, (off_t)address);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return -1;
+        }
+        dest += got;
+        address += got;
+        length -= got;
+    }
+    return 0;
+}
 
+/**
+ * Load the whole FAT region into fat_cache.
+ *
+ * The FAT starts at mbr.fat_offset (in sectors) and has one 32-bit entry per
+ * cluster, plus the two reserved entries at the front.
+ * Return: 0 on success, -1 if the table could not be allocated or read.
+ */
+static int load_fat(void)
+{
+    uint64_t sector_size = (uint64_t)1 << mbr.bytes_per_sector_shift;
 
-       // Just do these things for full marks :
-       Specifically checks the following fields for validity
+    fat_entries = mbr.cluster_count + 2;
+    if ((uint64_t)fat_entries * sizeof(uint32_t) > (uint64_t)mbr.fat_length * sector_size)
+    {
+        return -1; // FAT is too short to describe every cluster in the heap
+    }
 
-        FileSystemName
-        MustBeZero
-F       FirstClusterOfRootDirectory
+    fat_cache = malloc((size_t)fat_entries * sizeof(uint32_t));
+    if (!fat_cache)
+    {
+        return -1;
+    }
+
+    if (device_read(fat_cache, (size_t)fat_entries * sizeof(uint32_t), mbr.fat_offset * sector_size) != 0)
+    {
+        free(fat_cache);
+        fat_cache = NULL;
+        return -1;
+    }
+    return 0;
+}
 
+/**
+ * Follow the FAT chain one hop from `cluster`.
+ *
+ * Anything that isn't a valid heap cluster (free, bad, or out of range) is
+ * treated as the end of the chain so a corrupt FAT can't send us off the end
+ * of the table or the image.
  */
-nqp_error nqp_mount(const char *source, nqp_fs_type fs_type)
+static uint32_t fat_next(uint32_t cluster)
 {
-
-    // Validate input parameters
-    if (!source)
+    STAT_ADD(fat_lookups, 1);
+    if (cluster < 2 || cluster >= fat_entries)
     {
-        return NQP_INVAL;
+        return 0xFFFFFFFF;
     }
-    if (fs_type != NQP_FS_EXFAT)
+
+    uint32_t next = fat_cache[cluster];
+    if (next < 2 || next >= fat_entries)
     {
-        return NQP_UNSUPPORTED_FS;
+        return 0xFFFFFFFF;
     }
+    return next;
+}
 
-    // Open the file system image
-    fs_image = fopen(source, "rb");
-    if (!fs_image)
+/**
+ * Size of one cluster in bytes.
+ */
+static uint32_t bytes_per_cluster(void)
+{
+    return (uint32_t)1 << (mbr.bytes_per_sector_shift + mbr.sectors_per_cluster_shift);
+}
+
+/**
+ * Byte address of the start of `cluster` in the image.
+ */
+static uint64_t cluster_address(uint32_t cluster)
+{
+    return ((uint64_t)mbr.cluster_heap_offset << mbr.bytes_per_sector_shift) +
+           (uint64_t)(cluster - 2) * bytes_per_cluster();
+}
+
+/**
+ * Set up the cluster cache for a newly mounted volume. Failing to allocate
+ * it just leaves the cache off.
+ */
+static void cache_init(void)
+{
+    size_t cluster_size = bytes_per_cluster();
+    size_t capacity = cache_clusters_wanted;
+    if (fs_map || cluster_size > CACHE_MAX_BYTES)
+        capacity = 0; // The mapping already is a cache
+    if (capacity > CACHE_MAX_BYTES / cluster_size)
+        capacity = CACHE_MAX_BYTES / cluster_size;
+    if (capacity > mbr.cluster_count)
+        capacity = mbr.cluster_count;
+    if (capacity == 0)
+        return;
+
+    uint32_t buckets = 1;
+    while (buckets < capacity)
+        buckets <<= 1;
+
+    cache_slots = calloc(capacity, sizeof(cache_slot));
+    cache_data = malloc(capacity * cluster_size);
+    cache_buckets = malloc(buckets * sizeof(int32_t));
+    if (!cache_slots || !cache_data || !cache_buckets)
     {
-        return NQP_INVAL;
+        free(cache_slots);
+        free(cache_data);
+        free(cache_buckets);
+        cache_slots = NULL;
+        cache_data = NULL;
+        cache_buckets = NULL;
+        return;
     }
+    for (uint32_t i = 0; i < buckets; i++)
+        cache_buckets[i] = -1;
+    cache_bucket_mask = buckets - 1;
+    cache_capacity = capacity;
+    cache_hand = 0;
+    cache_hits = cache_misses = cache_evictions = 0;
+}
 
-    // Read the Main Boot Record
-    if (fread(&mbr, sizeof(main_boot_record), 1, fs_image) != 1)
+static void cache_release(void)
+{
+    free(cache_slots);
+    free(cache_data);
+    free(cache_buckets);
+    cache_slots = NULL;
+    cache_data = NULL;
+    cache_buckets = NULL;
+    cache_capacity = 0;
+}
+
+// Knuth's multiplicative hash; clusters of one file are often consecutive.
+static uint32_t cache_bucket(uint32_t cluster)
+{
+    return (cluster * 2654435761u) & cache_bucket_mask;
+}
+
+/**
+ * Copy `length` bytes at `offset` in a cached cluster into dst.
+ * Return: 1 on a hit, 0 if the cluster isn't cached (or the cache is off).
+ */
+static int cache_get(uint32_t cluster, size_t offset, size_t length, void *dst)
+{
+    if (cache_capacity == 0)
+        return 0;
+
+    int hit = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int32_t slot = cache_buckets[cache_bucket(cluster)]; slot >= 0; slot = cache_slots[slot].hash_next)
     {
-        fclose(fs_image);
-        fs_image = NULL;
-        return NQP_FSCK_FAIL;
+        if (cache_slots[slot].cluster == cluster)
+        {
+            memcpy(dst, cache_data + (size_t)slot * bytes_per_cluster() + offset, length);
+            cache_slots[slot].referenced = 1;
+            hit = 1;
+            break;
+        }
     }
-
-    // Validate the file system name and boot signature
-    if (strncmp(mbr.fs_name, "EXFAT   ", 8) != 0 || mbr.boot_signature != 0xAA55)
+    if (hit)
     {
-        fclose(fs_image);
-        fs_image = NULL;
-        return NQP_FSCK_FAIL;
+        cache_hits++;
+        STAT_ADD(cache_hits, 1);
+    }
+    else
+    {
+        cache_misses++;
+        STAT_ADD(cache_misses, 1);
     }
+    pthread_mutex_unlock(&cache_lock);
+    return hit;
+}
 
-    // Check the Must be zero thing
-    // The must_be_zero field in the exFAT Main Boot Record is a section of 53 bytes that must be entirely zero.
-    // If any byte in this field is non-zero, the file system is considered corrupt.
-    // Validate must_be_zero field (Ensure all 53 bytes are zero)
-    for (size_t i = 0; i < sizeof(mbr.must_be_zero); i++)
+/**
+ * Add a whole cluster that was just read from the image to the cache,
+ * evicting the first slot the CLOCK hand finds unreferenced.
+ */
+static void cache_put(uint32_t cluster, const void *data)
+{
+    if (cache_capacity == 0)
+        return;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int32_t slot = cache_buckets[cache_bucket(cluster)]; slot >= 0; slot = cache_slots[slot].hash_next)
     {
-        if (mbr.must_be_zero[i] != 0)
-        { // If any byte is non-zero, the file system is corrupt
-            printf("ERROR: must_be_zero field is not all zero!\n");
-            fclose(fs_image);
-            fs_image = NULL;
-            return NQP_FSCK_FAIL;
+        if (cache_slots[slot].cluster == cluster)
+        {
+            pthread_mutex_unlock(&cache_lock); // Another thread read it too
+            return;
         }
     }
 
-    // Validate FirstClusterOfRootDirectory
+    while (cache_slots[cache_hand].cluster != 0 && cache_slots[cache_hand].referenced)
+    {
+        cache_slots[cache_hand].referenced = 0; // Second chance
+        cache_hand = (cache_hand + 1) % cache_capacity;
+    }
+    int32_t victim = (int32_t)cache_hand;
+    cache_hand = (cache_hand + 1) % cache_capacity;
 
-    // Validate `first_cluster_of_root_directory`
-    if (mbr.first_cluster_of_root_directory < 2)
+    cache_slot *entry = &cache_slots[victim];
+    if (entry->cluster != 0)
     {
-        printf("ERROR: Invalid FirstClusterOfRootDirectory: %u\n", mbr.first_cluster_of_root_directory);
-        fclose(fs_image);
-        fs_image = NULL;
-        return NQP_FSCK_FAIL;
+        int32_t *link = &cache_buckets[cache_bucket(entry->cluster)];
+        while (*link != victim)
+            link = &cache_slots[*link].hash_next;
+        *link = entry->hash_next;
+        cache_evictions++;
     }
 
-    // Set the mounted state
-    is_mounted = 1;
-    return NQP_OK;
+    memcpy(cache_data + (size_t)victim * bytes_per_cluster(), data, bytes_per_cluster());
+    entry->cluster = cluster;
+    entry->referenced = 0;
+    entry->hash_next = cache_buckets[cache_bucket(cluster)];
+    cache_buckets[cache_bucket(cluster)] = victim;
+    pthread_mutex_unlock(&cache_lock);
 }
 
 /**
- * Unmount the file system.
+ * Read part of one cluster through the cluster cache.
+ *
+ * Parameters:
+ *  * scratch: A cluster sized buffer, used to read the whole cluster on a miss.
+ * Return: 0 on success, -1 on a read error.
  */
+static int cached_cluster_read(uint32_t cluster, size_t offset, size_t length, void *dst, uint8_t *scratch)
+{
+    if (cache_get(cluster, offset, length, dst))
+        return 0;
+    if (device_read(scratch, bytes_per_cluster(), cluster_address(cluster)) != 0)
+        return -1;
+    cache_put(cluster, scratch);
+    memcpy(dst, scratch + offset, length);
+    return 0;
+}
 
 /**
- * "Unmount" the mounted file system.
+ * Get at the contents of `cluster`.
  *
- * This function should be called to flush any changes to the file system's
- * volume (there shouldn't be! All operations are read only.)
+ * With the mapped backend this points straight into the image and `scratch`
+ * is not used (it may be NULL). Otherwise the cluster is copied into
+ * `scratch`, which must hold a whole cluster, from the cluster cache or the
+ * image.
+ * Return: the cluster's bytes, or NULL on a read error.
+ */
+static const uint8_t *cluster_data(uint32_t cluster, uint8_t *scratch)
+{
+    uint64_t address = cluster_address(cluster);
+    if (fs_map)
+    {
+        if (address > fs_map_size || bytes_per_cluster() > fs_map_size - address)
+        {
+            return NULL;
+        }
+        return fs_map + address;
+    }
+    if (cached_cluster_read(cluster, 0, bytes_per_cluster(), scratch, scratch) != 0)
+    {
+        return NULL;
+    }
+    return scratch;
+}
+
+/**
+ * Step from logical cluster `index` of a chain to the next one.
  *
- * Return: NQP_INVAL on error (e.g., there is no fs currently mounted) or
- *         NQP_OK on success.
+ * Chains flagged NoFatChain are allocated contiguously and their FAT entries
+ * are not valid, so the next cluster is simply the following one until
+ * data_length is used up. Everything else is looked up in the FAT.
  */
-nqp_error nqp_unmount(void)
+static uint32_t chain_next(uint32_t cluster, uint32_t index, int no_fat_chain, uint64_t data_length)
 {
-    if (!is_mounted || !fs_image)
+    if (no_fat_chain)
     {
-        return NQP_INVAL;
+        if ((uint64_t)(index + 1) * bytes_per_cluster() >= data_length || cluster + 1 >= fat_entries)
+        {
+            return 0xFFFFFFFF;
+        }
+        return cluster + 1;
     }
-    fclose(fs_image);
-    fs_image = NULL;
-    is_mounted = 0;
-    return NQP_OK;
+    return fat_next(cluster);
 }
 
 /**
- * Open a file in the mounted file system.
+ * Expand a compressed up-case table into up_case. In the compressed form a
+ * 0xFFFF followed by a count stands for that many code units that map to
+ * themselves; any other value is the mapping of the next code unit.
  */
+static void expand_up_case(const uint16_t *table, size_t length)
+{
+    uint32_t next = 0; // next code unit to be mapped
+    for (size_t i = 0; i < length && next < 0x10000; i++)
+    {
+        if (table[i] == 0xFFFF && i + 1 < length)
+        {
+            next += table[++i]; // identity run, already in place
+        }
+        else
+        {
+            up_case[next++] = table[i];
+        }
+    }
+}
 
 /**
- * Open the file at pathname in the "mounted" file system.
- *
- * Parameters:
- *  * pathname: The path of the file or directory in the file system that
- *              should be opened.  Must not be NULL.
- * Return: -1 on error, or a nonnegative integer on success. The nonnegative
- *         integer is a file descriptor.
+ * Find the first entry of type `type` in the root directory, where the
+ * volume's metadata entries (allocation bitmap, up-case table) live.
+ * Return: 1 if found (stored in entry), 0 if not, -1 on a read error.
  */
-int nqp_open(const char *pathname)
+static int find_root_entry(uint8_t type, directory_entry *found)
 {
-    if (!is_mounted || !pathname)
+    size_t cluster_size = bytes_per_cluster();
+    uint8_t *cluster_buffer = fs_map ? NULL : malloc(cluster_size);
+    if (!fs_map && !cluster_buffer)
         return -1;
 
-    uint32_t current_cluster = mbr.first_cluster_of_root_directory;
-    uint32_t file_cluster = 0;
-    uint64_t file_size = 0;
-    uint32_t create_time, modify_time, access_time;
-    uint16_t file_attributes;
+    int result = 0;
+    int done = 0; // found it, or reached the end of the directory
+    uint32_t cluster = mbr.first_cluster_of_root_directory;
+    for (uint32_t index = 0; cluster != 0xFFFFFFFF && !done; cluster = chain_next(cluster, index++, 0, 0))
+    {
+        const directory_entry *entry = (const directory_entry *)cluster_data(cluster, cluster_buffer);
+        if (!entry)
+        {
+            result = -1;
+            break;
+        }
+        for (size_t i = 0; i < cluster_size / sizeof(directory_entry) && !done; i++)
+        {
+            if (entry[i].entry_type == type)
+            {
+                *found = entry[i];
+                result = done = 1;
+            }
+            else if (entry[i].entry_type == DENTRY_TYPE_END)
+            {
+                done = 1;
+            }
+        }
+    }
+    free(cluster_buffer);
+    return result;
+}
+
+/**
+ * Read `length` bytes of the FAT chain starting at `first_cluster`.
+ * Return: 0 on success, -1 on a read error or a chain that is too short.
+ */
+static int read_chain(uint32_t first_cluster, void *buffer, size_t length)
+{
+    size_t cluster_size = bytes_per_cluster();
+    size_t copied = 0;
+    uint32_t cluster = first_cluster;
+    for (uint32_t index = 0; copied < length; cluster = chain_next(cluster, index++, 0, 0))
+    {
+        size_t chunk = length - copied < cluster_size ? length - copied : cluster_size;
+        if (cluster < 2 || cluster >= fat_entries ||
+            device_read((uint8_t *)buffer + copied, chunk, cluster_address(cluster)) != 0)
+        {
+            return -1;
+        }
+        copied += chunk;
+    }
+    return 0;
+}
 
-    size_t cluster_size = (1 << mbr.bytes_per_sector_shift) * (1 << mbr.sectors_per_cluster_shift);
-    uint8_t *cluster_buffer = malloc(cluster_size);
+/**
+ * Find the up-case table in the root directory and load it into up_case.
+ * A volume without one gets the ASCII mapping, the minimum exFAT requires.
+ * Return: 0 on success, -1 on a read error or a bad table checksum.
+ */
+static int load_up_case_table(void)
+{
+    up_case = malloc(0x10000 * sizeof(uint16_t));
+    if (!up_case)
+        return -1;
+    for (uint32_t c = 0; c < 0x10000; c++)
+        up_case[c] = c;
 
-    // Post the open File to the OFT
-    if (!cluster_buffer)
+    // The up-case table entry sits near the start of the root directory.
+    directory_entry location;
+    int found = find_root_entry(DENTRY_TYPE_UP_CASE_TABLE, &location);
+    if (found < 0)
+        return -1;
+
+    if (!found)
+    {
+        for (uint32_t c = 'a'; c <= 'z'; c++)
+            up_case[c] = c - ('a' - 'A');
+        return 0;
+    }
+
+    // The table is at most 128 KB; read it whole, checksum it, then expand.
+    if (location.up_case.data_length == 0 || location.up_case.data_length > 0x10000 * sizeof(uint16_t))
+        return -1;
+    size_t length = location.up_case.data_length;
+    uint8_t *table = malloc(length);
+    if (!table)
+        return -1;
+    if (read_chain(location.up_case.first_cluster, table, length) != 0)
+    {
+        free(table);
+        return -1;
+    }
+
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < length; i++)
+        checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + table[i];
+    if (checksum != location.up_case.table_checksum)
+    {
+        free(table);
+        return -1;
+    }
+
+    expand_up_case((const uint16_t *)table, length / sizeof(uint16_t));
+    free(table);
+    return 0;
+}
+
+/**
+ * Count the allocated clusters in the bitmap. Four independent sums keep
+ * the popcount units busy; with POPCNT (or AVX-512 VPOPCNTQ) available the
+ * compiler turns this into a handful of instructions per 256 bits.
+ */
+static uint64_t bitmap_popcount(const uint64_t *words, size_t count)
+{
+    uint64_t sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        sum0 += __builtin_popcountll(words[i]);
+        sum1 += __builtin_popcountll(words[i + 1]);
+        sum2 += __builtin_popcountll(words[i + 2]);
+        sum3 += __builtin_popcountll(words[i + 3]);
+    }
+    for (; i < count; i++)
+        sum0 += __builtin_popcountll(words[i]);
+    return sum0 + sum1 + sum2 + sum3;
+}
+
+/**
+ * Find the runs of free clusters in the bitmap: how many there are and the
+ * longest. Whole words that are all free or all allocated are handled in
+ * one step; mixed words are walked a run at a time with count trailing
+ * zeros rather than a bit at a time.
+ */
+static void bitmap_free_runs(const uint64_t *words, size_t count, uint32_t clusters, uint32_t *runs,
+                             uint32_t *largest)
+{
+    uint64_t run = 0; // length of the free run in progress
+    *runs = 0;
+    *largest = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t free_bits = ~words[i];
+        unsigned valid = 64;
+        if (i == count - 1 && clusters % 64 != 0)
+        {
+            valid = clusters % 64; // Past the last cluster is not free space
+            free_bits &= (UINT64_C(1) << valid) - 1;
+        }
+
+        if (valid == 64 && free_bits == ~UINT64_C(0))
+        {
+            if (run == 0)
+                (*runs)++;
+            run += 64;
+            continue;
+        }
+
+        unsigned bit = 0;
+        while (bit < valid)
+        {
+            uint64_t rest = free_bits >> bit;
+            unsigned length;
+            if (rest & 1)
+            {
+                // Free clusters: the run goes on to the next allocated one.
+                length = (~rest == 0) ? 64 - bit : (unsigned)__builtin_ctzll(~rest);
+                if (length > valid - bit)
+                    length = valid - bit;
+                if (run == 0)
+                    (*runs)++;
+                run += length;
+            }
+            else
+            {
+                // Allocated clusters end the run in progress.
+                length = (rest == 0) ? 64 - bit : (unsigned)__builtin_ctzll(rest);
+                if (run > *largest)
+                    *largest = run;
+                run = 0;
+            }
+            bit += length;
+        }
+    }
+    if (run > *largest)
+        *largest = run;
+}
+
+/**
+ * Find the allocation bitmap in the root directory, load it and work out
+ * the free space figures for nqp_statfs. A volume without one mounts, but
+ * nqp_statfs then fails.
+ * Return: 0 on success, -1 on a read error or a bitmap too short for the
+ *         cluster heap.
+ */
+static int load_allocation_bitmap(void)
+{
+    directory_entry location;
+    int found = find_root_entry(DENTRY_TYPE_ALLOCATION_BITMAP, &location);
+    if (found <= 0)
+        return found;
+
+    uint32_t clusters = mbr.cluster_count;
+    size_t length = (clusters + 7) / 8;
+    if (location.bitmap.data_length < length)
+        return -1;
+
+    alloc_bitmap_words = (clusters + 63) / 64;
+    alloc_bitmap = calloc(alloc_bitmap_words, sizeof(uint64_t));
+    if (!alloc_bitmap)
+        return -1;
+    if (read_chain(location.bitmap.first_cluster, alloc_bitmap, length) != 0)
+    {
+        free(alloc_bitmap);
+        alloc_bitmap = NULL;
+        return -1;
+    }
+    if (clusters % 64 != 0)
+        alloc_bitmap[alloc_bitmap_words - 1] &= (UINT64_C(1) << (clusters % 64)) - 1;
+
+    volume_stats.cluster_size = bytes_per_cluster();
+    volume_stats.total_clusters = clusters;
+    volume_stats.used_clusters = bitmap_popcount(alloc_bitmap, alloc_bitmap_words);
+    volume_stats.free_clusters = clusters - volume_stats.used_clusters;
+    bitmap_free_runs(alloc_bitmap, alloc_bitmap_words, clusters, &volume_stats.free_runs,
+                     &volume_stats.largest_free_run);
+    volume_stats.fragmentation = volume_stats.free_clusters == 0
+                                     ? 0
+                                     : 1000 - (uint64_t)volume_stats.largest_free_run * 1000 / volume_stats.free_clusters;
+    return 0;
+}
+
+/**
+ * What nqp_open needs to know about a resolved path component; this is also
+ * the value stored in the dentry cache.
+ */
+typedef struct
+{
+    uint32_t first_cluster;
+    uint64_t size;       // data_length
+    uint16_t attributes; // 0x10 is the directory bit
+    int no_fat_chain;
+} dentry_info;
+
+// Dentry (path lookup) cache: normalised path -> dentry_info, so repeated
+// opens of the same path, or of siblings under a cached directory, skip the
+// directory scans. Paths that failed to resolve are cached as negative
+// entries. The volume is read-only, so entries never go stale while mounted;
+// the cache is emptied on mount and unmount. Bounded to DCACHE_SIZE entries
+// with least recently used eviction.
+#define DCACHE_SIZE 256
+#define DCACHE_BUCKETS 512 // power of two
+#define DCACHE_PATH_MAX 256
+
+typedef struct DCACHE_ENTRY
+{
+    char path[DCACHE_PATH_MAX]; // key, without a trailing NUL if it fills the buffer
+    size_t path_length;
+    uint32_t hash;
+    int negative; // path does not exist, info is unused
+    dentry_info info;
+    struct DCACHE_ENTRY *hash_next;
+    struct DCACHE_ENTRY *lru_prev; // towards the most recently used entry
+    struct DCACHE_ENTRY *lru_next;
+} dcache_entry;
+
+static dcache_entry dcache_pool[DCACHE_SIZE];
+static dcache_entry *dcache_buckets[DCACHE_BUCKETS];
+static dcache_entry *dcache_lru_head = NULL; // most recently used
+static dcache_entry *dcache_lru_tail = NULL; // next to be evicted
+static size_t dcache_used = 0;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define DCACHE_MISS 0
+#define DCACHE_HIT 1
+#define DCACHE_NEGATIVE 2
+
+// FNV-1a over the normalised path.
+static uint32_t dcache_hash(const char *path, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void dcache_lru_unlink(dcache_entry *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        dcache_lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        dcache_lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void dcache_lru_push_front(dcache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = dcache_lru_head;
+    if (dcache_lru_head)
+        dcache_lru_head->lru_prev = entry;
+    dcache_lru_head = entry;
+    if (!dcache_lru_tail)
+        dcache_lru_tail = entry;
+}
+
+static void dcache_hash_unlink(dcache_entry *entry)
+{
+    dcache_entry **link = &dcache_buckets[entry->hash & (DCACHE_BUCKETS - 1)];
+    while (*link && *link != entry)
+        link = &(*link)->hash_next;
+    if (*link)
+        *link = entry->hash_next;
+    entry->hash_next = NULL;
+}
+
+// Caller holds dcache_lock.
+static dcache_entry *dcache_find(const char *path, size_t length, uint32_t hash)
+{
+    dcache_entry *entry = dcache_buckets[hash & (DCACHE_BUCKETS - 1)];
+    while (entry)
+    {
+        if (entry->hash == hash && entry->path_length == length && memcmp(entry->path, path, length) == 0)
+            return entry;
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+/**
+ * Look up the first `length` bytes of a normalised path in the dentry cache.
+ * Return: DCACHE_HIT (and *info filled in), DCACHE_NEGATIVE or DCACHE_MISS.
+ */
+static int dcache_lookup(const char *path, size_t length, dentry_info *info)
+{
+    uint32_t hash = dcache_hash(path, length);
+    int result = DCACHE_MISS;
+
+    pthread_mutex_lock(&dcache_lock);
+    dcache_entry *entry = dcache_find(path, length, hash);
+    if (!entry)
+    {
+        STAT_ADD(dcache_misses, 1);
+    }
+    else
+    {
+        STAT_ADD(dcache_hits, 1);
+        dcache_lru_unlink(entry);
+        dcache_lru_push_front(entry);
+        if (entry->negative)
+        {
+            result = DCACHE_NEGATIVE;
+        }
+        else
+        {
+            *info = entry->info;
+            result = DCACHE_HIT;
+        }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return result;
+}
+
+/**
+ * Remember the result of resolving the first `length` bytes of a normalised
+ * path. A NULL info records that the path does not exist.
+ */
+static void dcache_insert(const char *path, size_t length, const dentry_info *info)
+{
+    if (length > DCACHE_PATH_MAX)
+        return;
+
+    uint32_t hash = dcache_hash(path, length);
+
+    pthread_mutex_lock(&dcache_lock);
+    dcache_entry *entry = dcache_find(path, length, hash);
+    if (entry)
+    {
+        // Another thread resolved the same path first, just refresh it.
+        dcache_lru_unlink(entry);
+    }
+    else
+    {
+        if (dcache_used < DCACHE_SIZE)
+        {
+            entry = &dcache_pool[dcache_used++];
+        }
+        else
+        {
+            entry = dcache_lru_tail; // Evict the least recently used entry
+            dcache_lru_unlink(entry);
+            dcache_hash_unlink(entry);
+        }
+        memcpy(entry->path, path, length);
+        entry->path_length = length;
+        entry->hash = hash;
+        entry->hash_next = dcache_buckets[hash & (DCACHE_BUCKETS - 1)];
+        dcache_buckets[hash & (DCACHE_BUCKETS - 1)] = entry;
+    }
+    entry->negative = (info == NULL);
+    if (info)
+        entry->info = *info;
+    dcache_lru_push_front(entry);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Forget every cached path, for mount and unmount.
+ */
+static void dcache_reset(void)
+{
+    pthread_mutex_lock(&dcache_lock);
+    memset(dcache_buckets, 0, sizeof(dcache_buckets));
+    for (size_t i = 0; i < dcache_used; i++)
+    {
+        dcache_pool[i].hash_next = NULL;
+        dcache_pool[i].lru_prev = dcache_pool[i].lru_next = NULL;
+    }
+    dcache_lru_head = dcache_lru_tail = NULL;
+    dcache_used = 0;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Drop everything that nqp_mount set up: the FAT, the mapping and the image
+ * descriptor. Safe to call on a partially mounted volume.
+ */
+static void release_image(void)
+{
+    dcache_reset();
+    cache_release();
+    free(up_case);
+    up_case = NULL;
+    free(alloc_bitmap);
+    alloc_bitmap = NULL;
+    alloc_bitmap_words = 0;
+    free(fat_cache);
+    fat_cache = NULL;
+    fat_entries = 0;
+    if (fs_map)
+    {
+        munmap((void *)fs_map, fs_map_size);
+        fs_map = NULL;
+        fs_map_size = 0;
+    }
+    if (fs_fd >= 0)
+    {
+        close(fs_fd);
+        fs_fd = -1;
+    }
+}
+
+/**
+ * Map the whole image read-only for the NQP_MOUNT_MMAP backend.
+ * Return: 0 on success, -1 if the image can't be mapped.
+ */
+static int map_image(void)
+{
+    struct stat st;
+    if (fstat(fs_fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX)
+    {
+        return -1;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fs_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    fs_map = map;
+    fs_map_size = (size_t)st.st_size;
+
+    // Directory lookups jump all over the heap; don't let the kernel read
+    // around every fault on a large volume. File reads ask for their runs
+    // explicitly (see nqp_read).
+    if (fs_map_size >= MMAP_ADVISE_THRESHOLD)
+    {
+        madvise(map, fs_map_size, MADV_RANDOM);
+    }
+    return 0;
+}
+
+/**
+ * Give the kernel a read-ahead hint for a long run of file data in the
+ * mapped backend. A per-range MADV_SEQUENTIAL would split the mapping into a
+ * separate VMA for every file that is read, so ask for the pages instead.
+ */
+static void advise_run(uint64_t address, size_t length)
+{
+    if (!fs_map || fs_map_size < MMAP_ADVISE_THRESHOLD || length < MMAP_WILLNEED_RUN)
+    {
+        return;
+    }
+
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)(fs_map + address) & ~(page - 1);
+    uintptr_t end = (uintptr_t)(fs_map + address + length);
+    madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+/**
+ * Ask the kernel to start reading part of the image in the background, so a
+ * later device_read finds it already cached. This only issues the request,
+ * it never waits for it.
+ */
+static void prefetch_range(uint64_t address, uint64_t length)
+{
+    if (fs_map)
+    {
+        if (address >= fs_map_size)
+            return;
+        if (length > fs_map_size - address)
+            length = fs_map_size - address;
+
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)(fs_map + address) & ~(page - 1);
+        uintptr_t end = (uintptr_t)(fs_map + address + length);
+        madvise((void *)start, end - start, MADV_WILLNEED);
+    }
+    else
+    {
+        posix_fadvise(fs_fd, (off_t)address, (off_t)length, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * Mount the file system.
+ *  What Does nqp_mount Need to Do?
+ * 1. Open the file system image (a binary file representing an exFAT-formatted disk).
+ * 2. Read the Main Boot Record (MBR) from the first sector.
+ * 3. Validate the following fields:
+ *       File System Name (fs_name): Must be "EXFAT".
+         MustBeZero (must_be_zero): Must be all zero bytes.
+         First Cluster of Root Directory (first_cluster_of_root_directory): Must be ≥ 2 (since cluster numbers start at 2).
+
+   4. Perform additional sanity checks :
+       Ensure the Boot Signature (boot_signature) is 0xAA55.
+       Ensure the volume size is reasonable.
+       Ensure the FAT Table is properly located.
+
+
+       // Just do these things for full marks :
+       Specifically checks the following fields for validity
+
+        FileSystemName
+        MustBeZero
+F       FirstClusterOfRootDirectory
+
+ */
+nqp_error nqp_mount(const char *source, nqp_fs_type fs_type)
+{
+    return nqp_mount_with(source, fs_type, NQP_MOUNT_DEFAULT);
+}
+
+/**
+ * Mount the file system with a choice of backend (see nqp_mount_flags).
+ */
+nqp_error nqp_mount_with(const char *source, nqp_fs_type fs_type, int flags)
+{
+
+    // Validate input parameters
+    if (!source)
+    {
+        return NQP_INVAL;
+    }
+    if (fs_type != NQP_FS_EXFAT)
+    {
+        return NQP_UNSUPPORTED_FS;
+    }
+
+    // Open the file system image
+    fs_fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (fs_fd < 0)
+    {
+        return NQP_INVAL;
+    }
+
+    stats_timing = (flags & NQP_MOUNT_TIMING) != 0;
+
+    if ((flags & NQP_MOUNT_MMAP) && map_image() != 0)
+    {
+        release_image();
+        return NQP_INVAL;
+    }
+
+    // Read the Main Boot Record
+    if (device_read(&mbr, sizeof(main_boot_record), 0) != 0)
+    {
+        release_image();
+        return NQP_FSCK_FAIL;
+    }
+
+    // Validate the file system name and boot signature
+    if (strncmp(mbr.fs_name, "EXFAT   ", 8) != 0 || mbr.boot_signature != 0xAA55)
+    {
+        release_image();
+        return NQP_FSCK_FAIL;
+    }
+
+    // Check the Must be zero thing
+    // The must_be_zero field in the exFAT Main Boot Record is a section of 53 bytes that must be entirely zero.
+    // If any byte in this field is non-zero, the file system is considered corrupt.
+    // Validate must_be_zero field (Ensure all 53 bytes are zero)
+    for (size_t i = 0; i < sizeof(mbr.must_be_zero); i++)
+    {
+        if (mbr.must_be_zero[i] != 0)
+        { // If any byte is non-zero, the file system is corrupt
+            printf("ERROR: must_be_zero field is not all zero!\n");
+            release_image();
+            return NQP_FSCK_FAIL;
+        }
+    }
+
+    // Validate FirstClusterOfRootDirectory
+
+    // Validate `first_cluster_of_root_directory`
+    if (mbr.first_cluster_of_root_directory < 2)
+    {
+        printf("ERROR: Invalid FirstClusterOfRootDirectory: %u\n", mbr.first_cluster_of_root_directory);
+        release_image();
+        return NQP_FSCK_FAIL;
+    }
+
+    // Pull the FAT into memory so chain walks don't hit the image
+    if (load_fat() != 0)
+    {
+        printf("ERROR: Could not load the FAT\n");
+        release_image();
+        return NQP_FSCK_FAIL;
+    }
+
+    // Before anything reads directory clusters through it
+    cache_init();
+
+    if (load_up_case_table() != 0)
+    {
+        printf("ERROR: Could not load the up-case table\n");
+        release_image();
+        return NQP_FSCK_FAIL;
+    }
+
+    if (load_allocation_bitmap() != 0)
+    {
+        printf("ERROR: Could not load the allocation bitmap\n");
+        release_image();
+        return NQP_FSCK_FAIL;
+    }
+
+    // Set the mounted state
+    is_mounted = 1;
+
+    if (flags & NQP_MOUNT_FSCK)
+    {
+        nqp_fsck_report report;
+        if (nqp_fsck(&report, 0) != 0)
+        {
+            for (size_t i = 0; i < report.message_count; i++)
+            {
+                printf("ERROR: %s\n", report.messages[i]);
+            }
+            printf("ERROR: Consistency check found %zu problems\n", report.problems);
+            is_mounted = 0;
+            release_image();
+            return NQP_FSCK_FAIL;
+        }
+    }
+    return NQP_OK;
+}
+
+/**
+ * Free the buffers that reads and listings hang off a descriptor.
+ */
+static void release_file_buffers(open_file_entry *file)
+{
+    free(file->cluster_buffer);
+    file->cluster_buffer = NULL;
+    free(file->name_arena);
+    file->name_arena = NULL;
+}
+
+/**
+ * Set the size of the cluster cache used by the next mount.
+ */
+void nqp_set_cache_size(size_t clusters)
+{
+    cache_clusters_wanted = clusters;
+}
+
+/**
+ * Report the cluster cache's size and counters.
+ */
+int nqp_get_cache_info(nqp_cache_info *info)
+{
+    if (!is_mounted || !info)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    info->capacity = cache_capacity;
+    info->hits = cache_hits;
+    info->misses = cache_misses;
+    info->evictions = cache_evictions;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+/**
+ * Report the volume's free space (see nqp_io.h).
+ */
+int nqp_statfs(nqp_statfs_info *info)
+{
+    if (!is_mounted || !info || !alloc_bitmap)
+    {
+        return -1;
+    }
+    *info = volume_stats;
+    return 0;
+}
+
+/**
+ * Snapshot (and optionally reset) the read path counters (see nqp_io.h).
+ */
+int nqp_stats(nqp_stats_info *info, int reset)
+{
+    if (!info)
+    {
+        return -1;
+    }
+
+    // Every field is a uint64_t, so the counters can be walked as an array.
+    _Static_assert(sizeof(nqp_stats_info) % sizeof(uint64_t) == 0, "nqp_stats_info holds only uint64_t");
+    uint64_t *from = (uint64_t *)&stats_counters;
+    uint64_t *to = (uint64_t *)info;
+    for (size_t i = 0; i < sizeof(nqp_stats_info) / sizeof(uint64_t); i++)
+    {
+        to[i] = reset ? __atomic_exchange_n(&from[i], 0, __ATOMIC_RELAXED) : __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/**
+ * Unmount the file system.
+ */
+
+/**
+ * "Unmount" the mounted file system.
+ *
+ * This function should be called to flush any changes to the file system's
+ * volume (there shouldn't be! All operations are read only.)
+ *
+ * Return: NQP_INVAL on error (e.g., there is no fs currently mounted) or
+ *         NQP_OK on success.
+ */
+nqp_error nqp_unmount(void)
+{
+    if (!is_mounted || fs_fd < 0)
+    {
+        return NQP_INVAL;
+    }
+    release_image();
+    for (int chunk = 0; chunk < fd_chunk_count; chunk++)
+    {
+        for (int i = 0; i < FD_CHUNK_SIZE; i++)
+        {
+            if (fd_chunks[chunk][i].state == SLOT_OPEN)
+            {
+                release_file_buffers(&fd_chunks[chunk][i]); // Left open by the caller
+            }
+            pthread_mutex_destroy(&fd_chunks[chunk][i].lock);
+        }
+        free(fd_chunks[chunk]);
+        fd_chunks[chunk] = NULL;
+    }
+    fd_chunk_count = 0;
+    fd_free_head = -1;
+    is_mounted = 0;
+    return NQP_OK;
+}
+
+/**
+ * The open file table entry for a descriptor, in O(1).
+ * Return: the entry, or NULL if fd is outside the table.
+ */
+static open_file_entry *fd_entry(int fd)
+{
+    if (fd < 0 || (fd >> FD_CHUNK_SHIFT) >= __atomic_load_n(&fd_chunk_count, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &fd_chunks[fd >> FD_CHUNK_SHIFT][fd & (FD_CHUNK_SIZE - 1)];
+}
+
+/**
+ * Add a chunk of free descriptors to the table. Caller holds fd_table_lock.
+ * Return: 0 on success, -1 if the table is at its limit or out of memory.
+ */
+static int grow_fd_table(void)
+{
+    if (fd_chunk_count == FD_MAX_CHUNKS)
+    {
+        return -1;
+    }
+    open_file_entry *chunk = calloc(FD_CHUNK_SIZE, sizeof(open_file_entry));
+    if (!chunk)
+    {
+        return -1;
+    }
+
+    // Thread the new descriptors onto the free list lowest first.
+    int base = fd_chunk_count << FD_CHUNK_SHIFT;
+    for (int i = FD_CHUNK_SIZE - 1; i >= 0; i--)
+    {
+        chunk[i].state = SLOT_FREE;
+        pthread_mutex_init(&chunk[i].lock, NULL);
+        chunk[i].next_free = fd_free_head;
+        fd_free_head = base + i;
+    }
+    fd_chunks[fd_chunk_count] = chunk;
+    __atomic_store_n(&fd_chunk_count, fd_chunk_count + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Claim a free slot in the open file table, growing it if needed.
+ * Return: the slot (the new descriptor), or -1 if no slot can be had.
+ */
+static int claim_slot(void)
+{
+    pthread_mutex_lock(&fd_table_lock);
+    if (fd_free_head < 0 && grow_fd_table() != 0)
+    {
+        pthread_mutex_unlock(&fd_table_lock);
+        return -1;
+    }
+    int slot = fd_free_head;
+    open_file_entry *file = fd_entry(slot);
+    fd_free_head = file->next_free;
+    __atomic_store_n(&file->state, SLOT_CLAIMED, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fd_table_lock);
+    return slot;
+}
+
+/**
+ * Put a descriptor that has just been marked SLOT_FREE back on the free list.
+ */
+static void release_slot(int slot)
+{
+    pthread_mutex_lock(&fd_table_lock);
+    open_file_entry *file = fd_entry(slot);
+    file->next_free = fd_free_head;
+    fd_free_head = slot;
+    pthread_mutex_unlock(&fd_table_lock);
+}
+
+/**
+ * Look up and lock the open file entry for a descriptor.
+ * Return: the locked entry, or NULL if fd is not an open descriptor. The
+ *         caller must unlock entry->lock when it is done.
+ */
+static open_file_entry *lock_open_file(int fd)
+{
+    open_file_entry *file = fd_entry(fd);
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    if (__atomic_load_n(&file->state, __ATOMIC_ACQUIRE) != SLOT_OPEN)
+    {
+        pthread_mutex_unlock(&file->lock);
+        return NULL; // Never opened, or closed by another thread
+    }
+    return file;
+}
+
+// A file name is at most 255 UTF-16 code units, which takes 17 FILE_NAME
+// entries after the FILE and stream extension entries. As UTF-8 it can take
+// up to 3 bytes per code unit.
+#define MAX_NAME_LENGTH 255
+#define MAX_NAME_ENTRIES ((MAX_NAME_LENGTH + 14) / 15)
+#define MAX_NAME_UTF8 (MAX_NAME_LENGTH * 3)
+
+/**
+ * Decode a UTF-8 name into UTF-16 code units, up-cased with the volume's
+ * up-case table, which is the form exFAT hashes and compares names in.
+ * Characters outside the BMP become surrogate pairs; encoded surrogates
+ * are accepted so that names from utf16_to_utf8 always round-trip.
+ *
+ * Parameters:
+ *  * units: Receives the up-cased code units.
+ * Return: the number of code units, or -1 if the name isn't valid UTF-8 or
+ *         is longer than MAX_NAME_LENGTH code units.
+ */
+static int name_to_up_case(const char *name, uint16_t units[MAX_NAME_LENGTH])
+{
+    const uint8_t *src = (const uint8_t *)name;
+    int length = 0;
+    while (*src)
+    {
+        if (length == MAX_NAME_LENGTH)
+            return -1;
+
+        uint32_t c = *src++;
+        if (c >= 0x80)
+        {
+            int more = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : -1;
+            if (more < 0 || c >= 0xF5)
+                return -1;
+            c &= 0x3F >> more;
+            for (int i = 0; i < more; i++, src++)
+            {
+                if ((*src & 0xC0) != 0x80)
+                    return -1; // Truncated sequence (this also stops at the NUL)
+                c = (c << 6) | (*src & 0x3F);
+            }
+            static const uint32_t smallest[] = {0, 0x80, 0x800, 0x10000};
+            if (c < smallest[more] || c > 0x10FFFF)
+                return -1; // Overlong form or out of range
+            if (c >= 0x10000)
+            {
+                if (length + 2 > MAX_NAME_LENGTH)
+                    return -1;
+                c -= 0x10000;
+                units[length++] = 0xD800 + (c >> 10);
+                units[length++] = 0xDC00 + (c & 0x3FF);
+                continue;
+            }
+        }
+        units[length++] = up_case[c];
+    }
+    return length;
+}
+
+/**
+ * exFAT NameHash of an up-cased name: each code unit is added low byte then
+ * high byte, rotating the 16-bit hash right by one bit before each add.
+ */
+static uint16_t name_hash(const uint16_t *units, size_t length)
+{
+    uint16_t hash = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        uint16_t c = units[i];
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+    }
+    return hash;
+}
+
+/**
+ * Compare the name held in the FILE_NAME entries of a set (starting at
+ * set[2]) with an up-cased name of the same length, ignoring case as exFAT
+ * does, without decoding it.
+ */
+static int set_name_equals(const directory_entry *set, const uint16_t *units, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (up_case[set[2 + i / 15].file_name.file_name[i % 15]] != units[i])
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Scan one directory for the entry named `name`.
+ *
+ * The name is decoded and up-cased once, into a buffer on the stack, and
+ * hashed. Entry sets whose stream extension has a different NameHash or
+ * name length are skipped without looking at their names, so only the
+ * (usually single) real candidate is compared. Names match ignoring case.
+ *
+ * Parameters:
+ *  * dir: The directory to scan.
+ *  * name: The component to look for (UTF-8, no slashes).
+ *  * found: Filled in with the entry when it is found.
+ *  * scratch: A cluster sized buffer, or NULL with the mapped backend.
+ * Return: 1 if found, 0 if the directory has no such entry, -1 on a read error.
+ */
+static int dir_lookup(const dentry_info *dir, const char *name, dentry_info *found, uint8_t *scratch)
+{
+    uint16_t units[MAX_NAME_LENGTH];
+    int decoded = name_to_up_case(name, units);
+    if (decoded < 0)
+        return 0; // No stored name can match it
+    size_t name_length = decoded;
+    uint16_t hash = name_hash(units, name_length);
+    int name_entries = (int)((name_length + 14) / 15);
+
+    size_t entries_per_cluster = bytes_per_cluster() / sizeof(directory_entry);
+    uint32_t current_cluster = dir->first_cluster;
+    uint32_t dir_index = 0; // logical cluster index within the directory
+
+    // The entries of the set being examined, up to the last FILE_NAME entry
+    // needed. They are copied out because a set can straddle a cluster
+    // boundary.
+    directory_entry set[2 + MAX_NAME_ENTRIES];
+    int set_entries = 0;   // collected so far; 0 when between sets
+    int secondary_left = 0; // secondary entries of the current set not yet seen
+
+    while (current_cluster != 0xFFFFFFFF)
+    { // Traverse FAT chain
+        const directory_entry *entry = (const directory_entry *)cluster_data(current_cluster, scratch);
+        if (!entry)
+            return -1;
+        STAT_ADD(dir_clusters_scanned, 1);
+
+        for (size_t i = 0; i < entries_per_cluster; i++)
+        {
+            if (set_entries == 0)
+            {
+                if (secondary_left > 0)
+                {
+                    secondary_left--; // Rest of a set that can't match
+                }
+                else if (entry[i].entry_type == DENTRY_TYPE_FILE)
+                {
+                    set[set_entries++] = entry[i];
+                    secondary_left = entry[i].file.secondary_count;
+                }
+                continue;
+            }
+
+            set[set_entries++] = entry[i];
+            secondary_left--;
+
+            if (set_entries == 2 &&
+                (entry[i].entry_type != DENTRY_TYPE_STREAM_EXTENSION ||
+                 entry[i].stream_extension.name_hash != hash ||
+                 entry[i].stream_extension.name_length != name_length ||
+                 secondary_left < name_entries))
+            {
+                set_entries = 0;
+                continue;
+            }
+            if (set_entries < 2 + name_entries)
+                continue;
+            set_entries = 0;
+
+            if (set_name_equals(set, units, name_length))
+            {
+                found->first_cluster = set[1].stream_extension.first_cluster;
+                found->size = set[1].stream_extension.data_length;
+                found->no_fat_chain = set[1].stream_extension.flags.no_fat_chain;
+                found->attributes = set[0].file.file_attributes;
+
+#ifdef NQP_DEBUG
+                printf("\nOpened file: %s\n", name);
+                printf("First Cluster: %u\n", found->first_cluster);
+                printf("File Size: %llu bytes\n", (unsigned long long)found->size);
+                printf("File Attributes: 0x%X\n", found->attributes);
+                printf("Created: %u, Modified: %u, Accessed: %u\n", set[0].file.create_timestamp,
+                       set[0].file.last_modified_timestamp, set[0].file.last_accessed_timestamp);
+#endif
+                return 1;
+            }
+        }
+
+        // Move to next cluster in the directory
+        current_cluster = chain_next(current_cluster, dir_index++, dir->no_fat_chain, dir->size);
+    }
+    return 0;
+}
+
+/**
+ * Open a file in the mounted file system.
+ */
+
+/**
+ * Open the file at pathname in the "mounted" file system.
+ *
+ * Parameters:
+ *  * pathname: The path of the file or directory in the file system that
+ *              should be opened.  Must not be NULL.
+ * Return: -1 on error, or a nonnegative integer on success. The nonnegative
+ *         integer is a file descriptor.
+ */
+static int open_path(const char *pathname)
+{
+    if (!is_mounted || !pathname)
+        return -1;
+
+    // Split the path into components and build the normalised form used as
+    // the dentry cache key ("/a//b/" becomes "/a/b"). prefix_length[i] is the
+    // length of the normalised path up to and including component i.
+    char path_copy[DCACHE_PATH_MAX];
+    char normalised[DCACHE_PATH_MAX];
+    char *components[DCACHE_PATH_MAX / 2];
+    size_t prefix_length[DCACHE_PATH_MAX / 2];
+    int depth = 0;
+    size_t length = 0;
+
+    if (strlen(pathname) >= sizeof(path_copy))
+        return -1;
+    strcpy(path_copy, pathname);
+
+    char *save_ptr;
+    for (char *token = strtok_r(path_copy, "/", &save_ptr); token; token = strtok_r(NULL, "/", &save_ptr))
+    {
+        size_t token_length = strlen(token);
+        normalised[length++] = '/';
+        memcpy(normalised + length, token, token_length);
+        length += token_length;
+        components[depth] = token;
+        prefix_length[depth++] = length;
+    }
+
+    // "/" opens the root directory, which always uses the FAT.
+    dentry_info node = {mbr.first_cluster_of_root_directory, 0, 0x10, 0};
+
+    // Start from the longest cached prefix; a cached miss anywhere on the
+    // path means the whole path doesn't exist.
+    int resolved = 0;
+    for (int i = depth; i > 0; i--)
+    {
+        int cached = dcache_lookup(normalised, prefix_length[i - 1], &node);
+        if (cached == DCACHE_NEGATIVE)
+            return -1;
+        if (cached == DCACHE_HIT)
+        {
+            resolved = i;
+            break;
+        }
+    }
+
+    // Scan the directories for the rest of the path.
+    uint8_t *cluster_buffer = NULL;
+    for (int i = resolved; i < depth; i++)
+    {
+        if (!(node.attributes & 0x10))
+        {
+            free(cluster_buffer);
+            return -1; // A file in the middle of the path
+        }
+
+        // The mapped backend parses directory clusters in place.
+        if (!fs_map && !cluster_buffer)
+        {
+            cluster_buffer = malloc(bytes_per_cluster());
+            if (!cluster_buffer)
+                return -1;
+        }
+
+        dentry_info child;
+        int found = dir_lookup(&node, components[i], &child, cluster_buffer);
+        if (found < 0)
+        {
+            free(cluster_buffer);
+            return -1;
+        }
+        if (found == 0)
+        {
+            dcache_insert(normalised, prefix_length[i], NULL);
+            free(cluster_buffer);
+            return -1; // File not found
+        }
+        dcache_insert(normalised, prefix_length[i], &child);
+        node = child;
+    }
+    free(cluster_buffer);
+
+    // Post the open file to the OFT; the slot number is the descriptor.
+    int slot = claim_slot();
+    if (slot < 0)
+    {
+        return -1; // Too many open files
+    }
+
+    open_file_entry *file = fd_entry(slot);
+    file->start_cluster = node.first_cluster;
+    file->file_size = node.size; // Consider using valid_data_length here if preferred
+    file->offset = 0;            // Initial read offset is 0
+    file->cursor.cluster = node.first_cluster;
+    file->cursor.index = 0;
+    file->pread_hint = file->cursor;
+    file->dir_entry = 0;
+    file->cluster_buffer = NULL;
+    file->buffered_cluster = 0;
+    file->name_arena = NULL;
+    file->ra_next_offset = 0; // Reading from the start counts as sequential
+    file->ra_until = 0;
+    file->ra_window = 0;
+    file->no_fat_chain = node.no_fat_chain;
+    file->is_directory = (node.attributes & 0x10) != 0;
+    __atomic_store_n(&file->state, SLOT_OPEN, __ATOMIC_RELEASE);
+    return slot;
+}
+
+/**
+ * Open a file (see open_path), timing the call for nqp_stats.
+ */
+int nqp_open(const char *pathname)
+{
+    uint64_t start = stats_clock();
+    int fd = open_path(pathname);
+    stats_latency(&stats_counters.open, start);
+    return fd;
+}
+
+/**
+ * Close the file referred to by the descriptor.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to close. Must be a nonnegative integer.
+ * Return: -1 on error or 0 on success.
+ */
+int nqp_close(int fd)
+{
+    if (!is_mounted)
+    {
+        return -1;
+    }
+
+    open_file_entry *file = lock_open_file(fd);
+    if (file == NULL)
+    {
+        return -1; // Invalid file descriptor
+    }
+
+    release_file_buffers(file);
+
+    // Mark the slot free in the OFT so nqp_open can hand it out again
+    __atomic_store_n(&file->state, SLOT_FREE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&file->lock);
+    release_slot(fd);
+    return 0;
+}
+
+/**
+ * The descriptor's cluster sized scratch buffer, allocated on first use.
+ * Return: the buffer, or NULL if it can't be allocated.
+ */
+static uint8_t *file_scratch(open_file_entry *file)
+{
+    if (!file->cluster_buffer)
+    {
+        file->cluster_buffer = malloc(bytes_per_cluster());
+        file->buffered_cluster = 0;
+    }
+    return file->cluster_buffer;
+}
+
+/**
+ * The extent of an open file, for read_range.
+ */
+static file_extent file_extent_of(const open_file_entry *file)
+{
+    file_extent extent = {file->start_cluster, file->file_size, file->no_fat_chain};
+    return extent;
+}
+
+/**
+ * Move a chain cursor to logical cluster `index` of a file.
+ *
+ * Walking forward only costs the distance from the cursor; going backwards
+ * has to restart from start_cluster because the FAT is singly linked.
+ * Contiguous (NoFatChain) files don't need the FAT at all.
+ * Return: the cluster number, or 0xFFFFFFFF if the chain ends first.
+ */
+static uint32_t chain_seek(const file_extent *extent, chain_cursor *cursor, uint32_t index)
+{
+    if (extent->no_fat_chain)
+    {
+        if ((uint64_t)index * bytes_per_cluster() >= extent->size ||
+            (uint64_t)extent->start_cluster + index >= fat_entries)
+        {
+            return 0xFFFFFFFF;
+        }
+        cursor->cluster = extent->start_cluster + index;
+        cursor->index = index;
+        return cursor->cluster;
+    }
+
+    if (index < cursor->index)
+    {
+        cursor->cluster = extent->start_cluster;
+        cursor->index = 0;
+    }
+
+    while (cursor->index < index)
+    {
+        uint32_t next = fat_next(cursor->cluster);
+        if (next == 0xFFFFFFFF)
+        {
+            return 0xFFFFFFFF; // Chain is shorter than the file claims
+        }
+        cursor->cluster = next;
+        cursor->index++;
+    }
+    return cursor->cluster;
+}
+
+/**
+ * Read part of one cluster of a file. With the cluster cache on, a miss
+ * fills the cache using the descriptor's scratch buffer; without a
+ * descriptor (nqp_pread) only hits are taken from the cache.
+ *
+ * A descriptor that read-ahead has seen reading sequentially is streaming
+ * through the file and won't come back: its clusters are kept in its own
+ * scratch buffer only, so a large file read in small pieces doesn't evict
+ * the directory clusters that path lookups depend on.
+ * Return: 0 on success, -1 on a read error.
+ */
+static int partial_cluster_read(uint32_t cluster, size_t offset, size_t length, void *dst,
+                                open_file_entry *scratch_owner)
+{
+    if (scratch_owner)
+    {
+        uint8_t *scratch = file_scratch(scratch_owner);
+        if (!scratch)
+            return -1;
+        if (scratch_owner->buffered_cluster != cluster)
+        {
+            int streaming = scratch_owner->ra_window > 0 && scratch_owner->offset == scratch_owner->ra_next_offset;
+            if (!streaming && cache_get(cluster, offset, length, dst))
+                return 0;
+            if (device_read(scratch, bytes_per_cluster(), cluster_address(cluster)) != 0)
+            {
+                scratch_owner->buffered_cluster = 0;
+                return -1;
+            }
+            scratch_owner->buffered_cluster = cluster;
+            if (!streaming)
+                cache_put(cluster, scratch);
+        }
+        memcpy(dst, scratch + offset, length);
+        return 0;
+    }
+    if (cache_get(cluster, offset, length, dst))
+        return 0;
+    return device_read(dst, length, cluster_address(cluster) + offset);
+}
+
+/**
+ * Read up to `count` bytes at `offset` in a file, moving `cursor` along its
+ * chain. Neither touches any descriptor, so this runs without a lock when
+ * the extent and cursor are the caller's own.
+ *
+ * Parameters:
+ *  * scratch_owner: The descriptor whose scratch buffer may be used to fill
+ *                   the cluster cache, or NULL.
+ * Return: The number of bytes read, 0 at or past the end of the file, or -1
+ *         on error.
+ */
+static ssize_t read_range(const file_extent *extent, chain_cursor *cursor, void *buffer, size_t count,
+                          uint64_t offset, open_file_entry *scratch_owner)
+{
+    // If we have reached or passed the end of the file, return 0 (EOF).
+    if (offset >= extent->size)
+    {
+        return 0;
+    }
+
+    // Do not try to read beyond the file's end.
+    if (count > extent->size - offset)
+    {
+        count = extent->size - offset;
+    }
+
+    // Calculate the size of a cluster.
+    uint32_t cluster_size = (1 << mbr.bytes_per_sector_shift) *
+                            (1 << mbr.sectors_per_cluster_shift);
+
+    // Contiguous (NoFatChain) files are one run on disk, so the whole request
+    // maps to a single read straight into the caller's buffer.
+    if (extent->no_fat_chain)
+    {
+        uint64_t heap_bytes = (uint64_t)mbr.cluster_count * cluster_size;
+        uint64_t data_start = (uint64_t)(extent->start_cluster - 2) * cluster_size + offset;
+        if (extent->start_cluster < 2 || data_start + count > heap_bytes)
+        {
+            return -1; // Run extends past the end of the cluster heap
+        }
+
+        size_t offset_in_cluster = offset % cluster_size;
+        if (count < cluster_size && offset_in_cluster + count <= cluster_size && cache_capacity > 0)
+        {
+            // Only part of one cluster: go through the cluster cache.
+            uint32_t cluster = extent->start_cluster + offset / cluster_size;
+            if (partial_cluster_read(cluster, offset_in_cluster, count, buffer, scratch_owner) != 0)
+            {
+                return -1;
+            }
+            return count;
+        }
+
+        advise_run(cluster_address(extent->start_cluster) + offset, count);
+        if (device_read(buffer, count, cluster_address(extent->start_cluster) + offset) != 0)
+        {
+            return -1;
+        }
+        return count;
+    }
+
+    size_t total_bytes_read = 0;  // Total bytes read so far.
+    size_t bytes_to_read = count; // Bytes still needed to read.
+
+    // Determine the starting point: which cluster and what offset in that cluster.
+    // The cursor means this only walks the chain from where the previous
+    // read (or seek) left off.
+    size_t offset_in_cluster = offset % cluster_size;
+    uint32_t current_cluster = chain_seek(extent, cursor, offset / cluster_size);
+
+    // Read run-by-run. A run is a stretch of the chain whose clusters sit next
+    // to each other on disk, so it can be read with one pread directly into the
+    // caller's buffer. A partial first or last cluster is just a shorter run:
+    // with positioned reads there is no need to bounce it through a cluster
+    // sized buffer.
+    while (bytes_to_read > 0 && current_cluster != 0xFFFFFFFF)
+    {
+        size_t available = cluster_size - offset_in_cluster;
+        if (bytes_to_read < available && cache_capacity > 0)
+        {
+            // The rest of the request sits inside this cluster: serve it
+            // through the cluster cache rather than a short pread.
+            if (partial_cluster_read(current_cluster, offset_in_cluster, bytes_to_read,
+                                     (char *)buffer + total_bytes_read, scratch_owner) != 0)
+            {
+                return total_bytes_read > 0 ? (ssize_t)total_bytes_read : -1;
+            }
+            total_bytes_read += bytes_to_read;
+            bytes_to_read = 0;
+            break;
+        }
+
+        uint32_t run_start = current_cluster;
+        uint32_t run_clusters = 1;
+        size_t run_bytes = (bytes_to_read < available) ? bytes_to_read : available;
+
+        // Extend the run while the chain stays physically adjacent.
+        current_cluster = 0xFFFFFFFF;
+        while (run_bytes < bytes_to_read)
+        {
+            uint32_t next = chain_seek(extent, cursor, cursor->index + 1);
+            if (next == 0xFFFFFFFF)
+            {
+                break; // Chain is shorter than the file claims.
+            }
+            if (next != run_start + run_clusters)
+            {
+                current_cluster = next; // Next run starts here.
+                break;
+            }
+            run_clusters++;
+            run_bytes += (bytes_to_read - run_bytes < cluster_size) ? bytes_to_read - run_bytes : cluster_size;
+        }
+
+        advise_run(cluster_address(run_start) + offset_in_cluster, run_bytes);
+        if (device_read((char *)buffer + total_bytes_read, run_bytes,
+                        cluster_address(run_start) + offset_in_cluster) != 0)
+        {
+            return total_bytes_read > 0 ? (ssize_t)total_bytes_read : -1;
+        }
+
+        total_bytes_read += run_bytes;
+        bytes_to_read -= run_bytes;
+
+        // After the first cluster, subsequent runs start at a cluster boundary.
+        offset_in_cluster = 0;
+    }
+
+    return total_bytes_read; // Return the number of bytes read.
+}
+
+/**
+ * Read up to `count` bytes at the file's current offset and advance it.
+ * The caller holds file->lock.
+ */
+static ssize_t file_read(open_file_entry *file, void *buffer, size_t count)
+{
+    file_extent extent = file_extent_of(file);
+    ssize_t result = read_range(&extent, &file->cursor, buffer, count, file->offset, file);
+    if (result > 0)
+    {
+        file->offset += result;
+    }
+    return result;
+}
+
+/**
+ * Keep the next stretch of a sequentially read file in flight.
+ *
+ * Called after every successful nqp_read. A read that starts where the last
+ * one ended is sequential: once less than half the window is left ahead of
+ * the offset, the next window's worth of the file is handed to prefetch_range
+ * (following the FAT chain, a run at a time) and the window doubles up to
+ * READAHEAD_MAX. Any other read is a seek and collapses the window.
+ */
+static void file_readahead(open_file_entry *file, int sequential)
+{
+    if (!sequential)
+    {
+        file->ra_window = 0;
+        file->ra_until = file->offset;
+        return;
+    }
+
+    if (file->ra_until < file->offset)
+    {
+        file->ra_until = file->offset;
+    }
+    if (file->ra_window > 0 && file->ra_until - file->offset >= file->ra_window / 2)
+    {
+        return; // Still plenty in flight
+    }
+
+    file->ra_window = file->ra_window == 0 ? READAHEAD_MIN : file->ra_window * 2;
+    if (file->ra_window > READAHEAD_MAX)
+    {
+        file->ra_window = READAHEAD_MAX;
+    }
+
+    uint64_t start = file->ra_until;
+    uint64_t end = file->offset + file->ra_window;
+    if (end > file->file_size)
+    {
+        end = file->file_size;
+    }
+    if (start >= end)
+    {
+        return; // Everything up to the end of the file is already in flight
+    }
+    file->ra_until = end;
+
+    if (file->no_fat_chain)
+    {
+        prefetch_range(cluster_address(file->start_cluster) + start, end - start);
+        return;
+    }
+
+    // Walk from the descriptor's cursor (which is at or before `start`)
+    // without moving it, and prefetch each physically adjacent run.
+    uint32_t cluster_size = bytes_per_cluster();
+    uint32_t cluster = file->cursor.cluster;
+    uint32_t index = file->cursor.index;
+    uint32_t first_index = start / cluster_size;
+    uint32_t last_index = (end - 1) / cluster_size;
+
+    while (index < first_index && cluster != 0xFFFFFFFF)
+    {
+        cluster = fat_next(cluster);
+        index++;
+    }
+
+    uint64_t run_offset = start % cluster_size; // into the run's first cluster
+    while (cluster != 0xFFFFFFFF && index <= last_index)
+    {
+        uint32_t run_start = cluster;
+        uint32_t run_clusters = 1;
+        while (index + run_clusters <= last_index)
+        {
+            cluster = fat_next(cluster);
+            if (cluster != run_start + run_clusters)
+                break;
+            run_clusters++;
+        }
+        if (index + run_clusters > last_index)
+            cluster = 0xFFFFFFFF; // Whole window covered
+
+        prefetch_range(cluster_address(run_start) + run_offset, (uint64_t)run_clusters * cluster_size - run_offset);
+        index += run_clusters;
+        run_offset = 0;
+    }
+}
+
+// Had to change Read to use the OFT for the Prof's cat to work
+
+/**
+ * Read from a file desriptor.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to read from. Must be a nonnegative integer. The
+ *        file descriptor should refer to a file, not a directory.
+ *  * buffer: The buffer to read data into. Must not be NULL.
+ *  * count: The number of bytes to read into the buffer.
+ * Return: The number of bytes read, 0 at the end of the file, or -1 on error.
+ */
+static ssize_t read_fd(int fd, void *buffer, size_t count)
+{
+    // Check basic preconditions.
+    if (!is_mounted || !buffer || count == 0)
+    {
+        return -1; // Invalid parameters
+    }
+
+    // Look up the open file entry corresponding to the file descriptor.
+    open_file_entry *file = lock_open_file(fd);
+    if (file == NULL)
+    {
+        return -1; // The file is not open.
+    }
+
+    if (file->is_directory)
+    {
+        pthread_mutex_unlock(&file->lock);
+        return -1;
+    }
+
+    int sequential = file->offset == file->ra_next_offset;
+    ssize_t result = file_read(file, buffer, count);
+    if (result > 0)
+    {
+        file_readahead(file, sequential);
+    }
+    file->ra_next_offset = file->offset;
+    pthread_mutex_unlock(&file->lock);
+    return result;
+}
+
+/**
+ * Read from a file (see read_fd), timing the call for nqp_stats.
+ */
+ssize_t nqp_read(int fd, void *buffer, size_t count)
+{
+    uint64_t start = stats_clock();
+    ssize_t result = read_fd(fd, buffer, count);
+    stats_latency(&stats_counters.read, start);
+    return result;
+}
+
+/**
+ * Copy what nqp_pread needs out of a descriptor: the file's extent and the
+ * best known chain position at or before `offset` (the descriptor's own
+ * cursor, where the last nqp_pread ended, or the start of the file).
+ * Return: 0 on success, -1 if fd isn't an open file.
+ */
+static int snapshot_file(int fd, uint64_t offset, file_extent *extent, chain_cursor *cursor)
+{
+    open_file_entry *file = lock_open_file(fd);
+    if (file == NULL)
+    {
+        return -1;
+    }
+    if (file->is_directory)
+    {
+        pthread_mutex_unlock(&file->lock);
+        return -1;
+    }
+
+    *extent = file_extent_of(file);
+    uint32_t index = offset / bytes_per_cluster();
+    cursor->cluster = file->start_cluster;
+    cursor->index = 0;
+    if (file->cursor.index <= index && file->cursor.index > cursor->index)
+    {
+        *cursor = file->cursor;
+    }
+    if (file->pread_hint.index <= index && file->pread_hint.index > cursor->index)
+    {
+        *cursor = file->pread_hint;
+    }
+    pthread_mutex_unlock(&file->lock);
+    return 0;
+}
+
+/**
+ * Remember where an nqp_pread ended, so the next one nearby walks less chain.
+ */
+static void save_pread_hint(int fd, const file_extent *extent, const chain_cursor *cursor)
+{
+    open_file_entry *file = lock_open_file(fd);
+    if (file == NULL)
+    {
+        return; // Closed meanwhile
+    }
+    if (file->start_cluster == extent->start_cluster)
+    {
+        file->pread_hint = *cursor;
+    }
+    pthread_mutex_unlock(&file->lock);
+}
+
+/**
+ * Read from a file at a given offset without using or moving the
+ * descriptor's offset (see nqp_io.h).
+ */
+static ssize_t pread_fd(int fd, void *buffer, size_t count, off_t offset)
+{
+    if (!is_mounted || !buffer || offset < 0)
+    {
+        return -1;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // The descriptor is only locked to copy its extent out; the read itself
+    // runs unlocked with a private cursor, so many threads can read one
+    // descriptor at once.
+    file_extent extent;
+    chain_cursor cursor;
+    if (snapshot_file(fd, offset, &extent, &cursor) != 0)
+    {
+        return -1;
+    }
+
+    ssize_t result = read_range(&extent, &cursor, buffer, count, offset, NULL);
+    if (result > 0 && !extent.no_fat_chain)
+    {
+        save_pread_hint(fd, &extent, &cursor);
+    }
+    return result;
+}
+
+/**
+ * Positioned read (see pread_fd), timed as a read for nqp_stats.
+ */
+ssize_t nqp_pread(int fd, void *buffer, size_t count, off_t offset)
+{
+    uint64_t start = stats_clock();
+    ssize_t result = pread_fd(fd, buffer, count, offset);
+    stats_latency(&stats_counters.read, start);
+    return result;
+}
+
+/**
+ * Scatter read from a file at a given offset without using or moving the
+ * descriptor's offset (see nqp_io.h).
+ */
+static ssize_t preadv_fd(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    if (!is_mounted || !iov || iovcnt < 0 || iovcnt > IOV_MAX || offset < 0)
+    {
+        return -1;
+    }
+
+    file_extent extent;
+    chain_cursor cursor;
+    if (snapshot_file(fd, offset, &extent, &cursor) != 0)
+    {
+        return -1;
+    }
+
+    // One cursor carries on from buffer to buffer, so the chain is walked
+    // once for the whole request.
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len == 0)
+        {
+            continue;
+        }
+        ssize_t result = read_range(&extent, &cursor, iov[i].iov_base, iov[i].iov_len, offset + total, NULL);
+        if (result < 0)
+        {
+            if (total == 0)
+            {
+                return -1;
+            }
+            break;
+        }
+        total += result;
+        if ((size_t)result < iov[i].iov_len)
+        {
+            break; // End of file
+        }
+    }
+
+    if (total > 0 && !extent.no_fat_chain)
+    {
+        save_pread_hint(fd, &extent, &cursor);
+    }
+    return total;
+}
+
+/**
+ * Positioned scatter read (see preadv_fd), timed as a read for nqp_stats.
+ */
+ssize_t nqp_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    uint64_t start = stats_clock();
+    ssize_t result = preadv_fd(fd, iov, iovcnt, offset);
+    stats_latency(&stats_counters.read, start);
+    return result;
+}
+
+/**
+ * Reposition the offset of an open file.
+ *
+ * Only the offset is changed here; the chain cursor is moved lazily by the
+ * next nqp_read, which walks just the distance between the old and new
+ * positions when seeking forward.
+ */
+off_t nqp_lseek(int fd, off_t offset, int whence)
+{
+    if (!is_mounted)
+    {
+        return -1;
+    }
+
+    open_file_entry *file = lock_open_file(fd);
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    off_t base;
+    switch (whence)
+    {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = (off_t)file->offset;
+        break;
+    case SEEK_END:
+        base = (off_t)file->file_size;
+        break;
+    default:
+        pthread_mutex_unlock(&file->lock);
+        return -1;
+    }
+
+    if (offset < -base)
+    {
+        pthread_mutex_unlock(&file->lock);
+        return -1; // Would land before the start of the file
+    }
+    if (offset > INT64_MAX - base)
+    {
+        pthread_mutex_unlock(&file->lock);
+        errno = EOVERFLOW;
+        return -1; // The new offset wouldn't fit in an off_t
+    }
+
+    file->offset = (uint64_t)(base + offset);
+    off_t result = (off_t)file->offset;
+    pthread_mutex_unlock(&file->lock);
+    return result;
+}
+
+/**
+ * The directory cluster under the descriptor's cursor. With the pread
+ * backend the cluster is kept in the descriptor, so a listing reads each
+ * cluster once however many calls it takes.
+ * Return: the cluster's entries, or NULL on a read error.
+ */
+static const directory_entry *dir_cursor_entries(open_file_entry *dir)
+{
+    if (fs_map)
+    {
+        return (const directory_entry *)cluster_data(dir->cursor.cluster, NULL);
+    }
+
+    if (!file_scratch(dir))
+    {
+        return NULL;
+    }
+    if (dir->buffered_cluster != dir->cursor.cluster)
+    {
+        if (!cluster_data(dir->cursor.cluster, dir->cluster_buffer))
+            return NULL;
+        dir->buffered_cluster = dir->cursor.cluster;
+    }
+    return (const directory_entry *)dir->cluster_buffer;
+}
+
+/**
+ * Advance the descriptor's directory cursor past the next file entry set and
+ * copy that set out (it can straddle a cluster boundary).
+ *
+ * Parameters:
+ *  * dir: A locked directory descriptor.
+ *  * set: Receives the FILE, stream extension and FILE_NAME entries.
+ *  * set_entries: Receives how many entries were stored in set.
+ * Return: 1 if a set was found, 0 at the end of the directory, -1 on error.
+ */
+static int dir_next_set(open_file_entry *dir, directory_entry set[2 + MAX_NAME_ENTRIES], int *set_entries)
+{
+    size_t entries_per_cluster = bytes_per_cluster() / sizeof(directory_entry);
+    int collected = 0;
+    int wanted = 0; // entries of the current set that are worth keeping
+
+    while (dir->cursor.cluster != 0xFFFFFFFF)
+    {
+        const directory_entry *entries = dir_cursor_entries(dir);
+        if (!entries)
+            return -1;
+        if (dir->dir_entry == 0)
+            STAT_ADD(dir_clusters_scanned, 1);
+
+        while (dir->dir_entry < entries_per_cluster)
+        {
+            const directory_entry *entry = &entries[dir->dir_entry++];
+
+            if (collected == 0)
+            {
+                if (entry->entry_type == DENTRY_TYPE_END)
+                {
+                    // Stay at the end: later calls keep returning 0.
+                    dir->cursor.cluster = 0xFFFFFFFF;
+                    return 0;
+                }
+                if (entry->entry_type == DENTRY_TYPE_FILE && entry->file.secondary_count >= 2)
+                {
+                    set[collected++] = *entry;
+                    wanted = 1 + entry->file.secondary_count;
+                }
+                continue;
+            }
+
+            uint8_t expected = collected == 1 ? DENTRY_TYPE_STREAM_EXTENSION : DENTRY_TYPE_FILE_NAME;
+            if (entry->entry_type != expected)
+            {
+                // Broken set: drop it and look at this entry afresh.
+                dir->dir_entry--;
+                collected = 0;
+                continue;
+            }
+
+            set[collected++] = *entry;
+            if (collected == 2)
+            {
+                // Only the FILE_NAME entries holding the name are needed.
+                int name_entries = (entry->stream_extension.name_length + 14) / 15;
+                if (wanted > 2 + name_entries)
+                    wanted = 2 + name_entries;
+            }
+            if (collected == wanted)
+            {
+                *set_entries = collected;
+                return 1;
+            }
+        }
+
+        // Look up the next cluster in the directory chain.
+        dir->dir_entry = 0;
+        dir->cursor.cluster = chain_next(dir->cursor.cluster, dir->cursor.index++, dir->no_fat_chain, dir->file_size);
+    }
+    return 0;
+}
+
+/**
+ * Decode the name of an entry set collected by dir_next_set into `name` as
+ * UTF-8. The name's code units are gathered from its FILE_NAME entries and
+ * converted in one pass.
+ *
+ * Parameters:
+ *  * set_entries: The number of entries in set; at least 2.
+ *  * name: Room for MAX_NAME_UTF8 + 1 bytes.
+ * Return: the length of the name in bytes; name is NUL-terminated.
+ */
+static size_t set_name_utf8(const directory_entry *set, int set_entries, char *name)
+{
+    size_t length = set[1].stream_extension.name_length;
+    if (length > (size_t)(set_entries - 2) * 15)
+        length = (size_t)(set_entries - 2) * 15; // Set is short of name entries
+
+    uint16_t units[MAX_NAME_ENTRIES * 15];
+    for (size_t i = 0; i < length; i += 15)
+    {
+        memcpy(units + i, set[2 + i / 15].file_name.file_name, sizeof(set->file_name.file_name));
+    }
+    STAT_ADD(name_conversions, 1);
+    return utf16_to_utf8(units, length, name);
+}
+
+/**
+ * Read the next directory entry (one per call, see nqp_io.h).
+ */
+static ssize_t getdents_one(int fd, void *dirp, size_t count)
+{
+    if (!is_mounted || !dirp || count < 1)
+    {
+        return -1;
+    }
+
+    // The position in the directory lives in the descriptor, so several
+    // directories can be listed at once (and from different threads).
+    open_file_entry *dir = lock_open_file(fd);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    if (!dir->is_directory)
+    {
+        pthread_mutex_unlock(&dir->lock);
+        return -1;
+    }
+
+    directory_entry set[2 + MAX_NAME_ENTRIES];
+    int set_entries;
+    int found = dir_next_set(dir, set, &set_entries);
+    pthread_mutex_unlock(&dir->lock);
+    if (found <= 0)
+    {
+        return found;
+    }
+
+    char name[MAX_NAME_UTF8 + 1];
+    size_t name_len = set_name_utf8(set, set_entries, name);
+
+    nqp_dirent *result_entry = (nqp_dirent *)dirp;
+    result_entry->name = malloc(name_len + 1);
+    STAT_ADD(name_allocations, 1);
+    if (!result_entry->name)
+    {
+        return -1;
+    }
+    memcpy(result_entry->name, name, name_len + 1);
+    result_entry->name_len = name_len;
+    result_entry->inode_number = set[1].stream_extension.first_cluster;
+    result_entry->type = (set[0].file.file_attributes & 0x10) ? DT_DIR : DT_REG;
+    return sizeof(nqp_dirent); // Return the number of bytes (one entry).
+}
+
+/**
+ * Read the next directory entry (see getdents_one), timing the call for
+ * nqp_stats.
+ */
+ssize_t nqp_getdents(int fd, void *dirp, size_t count)
+{
+    uint64_t start = stats_clock();
+    ssize_t result = getdents_one(fd, dirp, count);
+    stats_latency(&stats_counters.getdents, start);
+    return result;
+}
+
+/**
+ * Fill in the metadata of an entry set collected by dir_next_set.
+ */
+static void set_stat(const directory_entry *set, nqp_stat *stat)
+{
+    stat->size = set[1].stream_extension.data_length;
+    stat->first_cluster = set[1].stream_extension.first_cluster;
+    stat->attributes = set[0].file.file_attributes;
+    stat->no_fat_chain = set[1].stream_extension.flags.no_fat_chain;
+    stat->create_timestamp = set[0].file.create_timestamp;
+    stat->modified_timestamp = set[0].file.last_modified_timestamp;
+    stat->accessed_timestamp = set[0].file.last_accessed_timestamp;
+}
+
+/**
+ * nqp_getdents_arena and nqp_getdents_stat: read up to `count` entries with
+ * their names in an arena and, if `stats` isn't NULL, their metadata.
+ */
+static ssize_t getdents_arena(int fd, nqp_dirent *dirp, nqp_stat *stats, size_t count, char *arena,
+                              size_t arena_size)
+{
+    if (!is_mounted || !dirp || count < 1)
+    {
+        return -1;
+    }
+
+    open_file_entry *dir = lock_open_file(fd);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    if (!dir->is_directory)
+    {
+        pthread_mutex_unlock(&dir->lock);
+        return -1;
+    }
+
+    if (!arena)
+    {
+        // Allocated once per descriptor and reused by every call.
+        if (!dir->name_arena)
+        {
+            dir->name_arena = malloc(NAME_ARENA_SIZE);
+            if (!dir->name_arena)
+            {
+                pthread_mutex_unlock(&dir->lock);
+                return -1;
+            }
+        }
+        arena = dir->name_arena;
+        arena_size = NAME_ARENA_SIZE;
+    }
+
+    size_t entries = 0;
+    size_t arena_used = 0;
+    directory_entry set[2 + MAX_NAME_ENTRIES];
+    int set_entries;
+
+    while (entries < count)
+    {
+        // Remember where this set starts, in case its name doesn't fit.
+        uint32_t cluster = dir->cursor.cluster;
+        uint32_t index = dir->cursor.index;
+        size_t entry = dir->dir_entry;
+
+        int found = dir_next_set(dir, set, &set_entries);
+        if (found < 0)
+        {
+            pthread_mutex_unlock(&dir->lock);
+            return entries > 0 ? (ssize_t)entries : -1;
+        }
+        if (found == 0)
+        {
+            break;
+        }
+
+        // The UTF-8 length isn't known until the name is decoded; decode it
+        // straight into the arena when even the longest form fits.
+        char decoded[MAX_NAME_UTF8 + 1];
+        size_t room = arena_size - arena_used;
+        int in_place = (size_t)set[1].stream_extension.name_length * 3 < room;
+        char *name = in_place ? arena + arena_used : decoded;
+        size_t name_len = set_name_utf8(set, set_entries, name);
+        if (name_len + 1 > room)
+        {
+            dir->cursor.cluster = cluster;
+            dir->cursor.index = index;
+            dir->dir_entry = entry;
+            if (entries == 0)
+            {
+                pthread_mutex_unlock(&dir->lock);
+                return -1; // Arena too small for even one name
+            }
+            break;
+        }
+
+        if (!in_place)
+        {
+            memcpy(arena + arena_used, decoded, name_len + 1);
+        }
+
+        nqp_dirent *result_entry = &dirp[entries++];
+        result_entry->name = arena + arena_used;
+        result_entry->name_len = name_len;
+        result_entry->inode_number = set[1].stream_extension.first_cluster;
+        result_entry->type = (set[0].file.file_attributes & 0x10) ? DT_DIR : DT_REG;
+        arena_used += result_entry->name_len + 1;
+        if (stats)
+        {
+            set_stat(set, &stats[entries - 1]);
+        }
+    }
+
+    pthread_mutex_unlock(&dir->lock);
+    return entries;
+}
+
+/**
+ * Read up to `count` directory entries whose names are stored in an arena
+ * (see nqp_io.h). Nothing is allocated per entry.
+ */
+ssize_t nqp_getdents_arena(int fd, nqp_dirent *dirp, size_t count, char *arena, size_t arena_size)
+{
+    uint64_t start = stats_clock();
+    ssize_t result = getdents_arena(fd, dirp, NULL, count, arena, arena_size);
+    stats_latency(&stats_counters.getdents, start);
+    return result;
+}
+
+/**
+ * As nqp_getdents_arena, also filling in each entry's metadata (see
+ * nqp_io.h).
+ */
+ssize_t nqp_getdents_stat(int fd, nqp_dirent *dirp, nqp_stat *stats, size_t count, char *arena, size_t arena_size)
+{
+    if (!stats)
+    {
+        return -1;
+    }
+    uint64_t start = stats_clock();
+    ssize_t result = getdents_arena(fd, dirp, stats, count, arena, arena_size);
+    stats_latency(&stats_counters.getdents, start);
+    return result;
+}
+
+/**
+ * Read as many directory entries as fit in `count` bytes, packed as
+ * nqp_dirent64 records (see nqp_io.h).
+ */
+static ssize_t getdents64_fd(int fd, void *dirp, size_t count)
+{
+    if (!is_mounted || !dirp)
+    {
         return -1;
+    }
 
-    char path_copy[256];
-    strncpy(path_copy, pathname, sizeof(path_copy));
-    char *token = strtok(path_copy, "/");
-
-    while (token != NULL)
+    open_file_entry *dir = lock_open_file(fd);
+    if (dir == NULL)
     {
-        int found = 0;
-
-        while (current_cluster != 0xFFFFFFFF)
-        { // Traverse FAT chain
-            uint32_t cluster_offset = mbr.cluster_heap_offset * (1 << mbr.bytes_per_sector_shift);
-            uint64_t cluster_address = cluster_offset + (current_cluster - 2) * cluster_size;
-
-            fseek(fs_image, cluster_address, SEEK_SET);
-            if (fread(cluster_buffer, cluster_size, 1, fs_image) != 1)
-            {
-                free(cluster_buffer);
-                return -1;
-            }
+        return -1;
+    }
+    if (!dir->is_directory)
+    {
+        pthread_mutex_unlock(&dir->lock);
+        return -1;
+    }
 
-            directory_entry *entry = (directory_entry *)cluster_buffer;
-            for (size_t i = 0; i < cluster_size / sizeof(directory_entry); i++)
-            {
-                if (entry[i].entry_type == DENTRY_TYPE_FILE)
-                {
-                    char *ascii_filename = unicode2ascii(entry[i + 2].file_name.file_name, 15);
-                    if (ascii_filename && strcmp(ascii_filename, token) == 0)
-                    {
-                        file_cluster = entry[i + 1].stream_extension.first_cluster;
-                        file_size = entry[i + 1].stream_extension.data_length;
-                        file_attributes = entry[i].file.file_attributes;
-                        create_time = entry[i].file.create_timestamp;
-                        modify_time = entry[i].file.last_modified_timestamp;
-                        access_time = entry[i].file.last_accessed_timestamp;
-
-                        printf("\nOpened file: %s\n", pathname);
-                        printf("File Descriptor (First Cluster): %u\n", file_cluster);
-                        printf("File Size: %llu bytes\n", (unsigned long long)file_size);
-                        printf("File Attributes: 0x%X\n", file_attributes);
-                        printf("Created: %u, Modified: %u, Accessed: %u\n", create_time, modify_time, access_time);
-
-                        free(ascii_filename);
-                        found = 1;
-
-                        for (int slot = 0; slot < MAX_OPEN_FILES; slot++)
-                        {
-                            if (!open_files[slot].in_use)
-                            {
-                                open_files[slot].in_use = 1;
-                                open_files[slot].start_cluster = file_cluster;
-                                open_files[slot].file_size = file_size; // Consider using valid_data_length here if preferred
-                                open_files[slot].offset = 0;            // Initial read offset is 0
-                                break;
-                            }
-                        }
-                        break;
-                    }
-                    free(ascii_filename);
-                }
-            }
+    uint8_t *out = dirp;
+    size_t used = 0;
+    directory_entry set[2 + MAX_NAME_ENTRIES];
+    int set_entries;
 
-            if (found)
-                break;
+    for (;;)
+    {
+        // Remember where this set starts, in case its record doesn't fit.
+        uint32_t cluster = dir->cursor.cluster;
+        uint32_t index = dir->cursor.index;
+        size_t entry = dir->dir_entry;
 
-            // Move to next cluster in the directory using the FAT table
-            fseek(fs_image, mbr.fat_offset * (1 << mbr.bytes_per_sector_shift) + current_cluster * sizeof(uint32_t), SEEK_SET);
-            fread(&current_cluster, sizeof(uint32_t), 1, fs_image);
+        int found = dir_next_set(dir, set, &set_entries);
+        if (found < 0)
+        {
+            pthread_mutex_unlock(&dir->lock);
+            return used > 0 ? (ssize_t)used : -1;
+        }
+        if (found == 0)
+        {
+            break;
         }
 
-        if (!found)
+        char name[MAX_NAME_UTF8 + 1];
+        size_t name_len = set_name_utf8(set, set_entries, name);
+        size_t record_length = NQP_DIRENT64_RECLEN(name_len);
+        if (used + record_length > count)
         {
-            free(cluster_buffer);
-            return -1; // File not found
+            dir->cursor.cluster = cluster;
+            dir->cursor.index = index;
+            dir->dir_entry = entry;
+            if (used == 0)
+            {
+                pthread_mutex_unlock(&dir->lock);
+                return -1; // Buffer too small for even one entry
+            }
+            break;
         }
 
-        token = strtok(NULL, "/");
-        if (token)
-            current_cluster = file_cluster;
+        nqp_dirent64 *record = (nqp_dirent64 *)(out + used);
+        record->inode_number = set[1].stream_extension.first_cluster;
+        record->record_length = record_length;
+        record->type = (set[0].file.file_attributes & 0x10) ? DT_DIR : DT_REG;
+        record->name_len = name_len;
+        memcpy(record->name, name, name_len + 1);
+        used += record_length;
     }
 
-    free(cluster_buffer);
-    return file_cluster; // Return first cluster as file descriptor
+    pthread_mutex_unlock(&dir->lock);
+    return used;
 }
 
 /**
- * Close the file referred to by the descriptor.
- *
- * Parameters:
- *  * fd: The file descriptor to close. Must be a nonnegative integer.
- * Return: -1 on error or 0 on success.
+ * Fill a buffer with directory records (see getdents64_fd), timing the call
+ * for nqp_stats.
  */
-int nqp_close(int fd)
+ssize_t nqp_getdents64(int fd, void *dirp, size_t count)
 {
-    if (!is_mounted || fd < 0)
-    {
-        return -1; // Invalid file descriptor
-    }
-
-    // If using an Open File Table (OFT), mark the file as closed
-    // For now, just return success since we are not tracking open files
-    return 0;
+    uint64_t start = stats_clock();
+    ssize_t result = getdents64_fd(fd, dirp, count);
+    stats_latency(&stats_counters.getdents, start);
+    return result;
 }
 
-// Had to change Read to use the OFT for the Prof's cat to work
+// Consistency check (nqp_fsck). Every chain on the volume is walked once,
+// starting from the directory tree: the root directory, the allocation
+// bitmap and up-case table, and every file and directory below. Each
+// cluster is claimed for its chain in fsck_owner; finding the chain's own
+// id already there means the chain loops, finding another chain's id means
+// two chains share the cluster. Directories are checked by a small pool of
+// threads fed from a queue, so separate subtrees are checked in parallel.
+// A final pass over the bitmap finds clusters marked allocated that no
+// chain reached.
+
+// Largest entry set: a FILE entry and up to 255 secondary entries.
+#define FSCK_MAX_SET 256
+
+// A directory waiting to be checked.
+typedef struct FSCK_DIRECTORY
+{
+    uint32_t first_cluster;
+    uint64_t size; // 0 for the root directory, whose length isn't recorded anywhere
+    int no_fat_chain;
+    int is_root;
+    struct FSCK_DIRECTORY *next;
+    char path[];
+} fsck_directory;
+
+typedef struct
+{
+    nqp_fsck_report *report;
+    pthread_mutex_t lock; // protects the queue, pending and report->messages
+    pthread_cond_t ready;
+    fsck_directory *queue;
+    size_t pending;  // directories queued or being checked
+    uint32_t *owner; // chain id holding each cluster, 0 if none
+    uint32_t next_id;
+} fsck_state;
 
 /**
- * Read data from a file.
- */
-/**
- * Read from a file desriptor.
- *
- * Parameters:
- *  * fd: The file descriptor to read from. Must be a nonnegative integer. The
- *        file descriptor should refer to a file, not a directory.
- *  * buffer: The buffer to read data into. Must not be NULL.
- *  * count: The number of bytes to read into the buffer.
- * Return: The number of bytes read, 0 at the end of the file, or -1 on error.
+ * Count a problem and keep its description if there is room.
  */
-ssize_t nqp_read(int fd, void *buffer, size_t count)
+static void fsck_problem(fsck_state *state, size_t *counter, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+static void fsck_problem(fsck_state *state, size_t *counter, const char *format, ...)
 {
-    // Check basic preconditions.
-    if (!is_mounted || fd < 2 || !buffer || count == 0)
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&state->lock);
+    nqp_fsck_report *report = state->report;
+    if (report->message_count < NQP_FSCK_MESSAGES)
     {
-        return -1; // Invalid parameters
+        va_list args;
+        va_start(args, format);
+        vsnprintf(report->messages[report->message_count++], sizeof(report->messages[0]), format, args);
+        va_end(args);
     }
+    pthread_mutex_unlock(&state->lock);
+}
 
-    // Look up the open file entry corresponding to the file descriptor.
-    // (We assume that fd is the file’s starting cluster number.)
-    open_file_entry *file = NULL;
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+/**
+ * Claim `cluster` for chain `id` and check that it is allocated.
+ * Return: 0 if the chain can go on, -1 if it has come back on itself, or 1 if
+ *         the cluster belongs to another chain (reported once, here).
+ */
+static int fsck_claim(fsck_state *state, uint32_t cluster, uint32_t id, const char *path)
+{
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&state->owner[cluster], &expected, id, 0, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
     {
-        if (open_files[i].in_use && open_files[i].start_cluster == (uint32_t)fd)
+        if (expected == id)
         {
-            file = &open_files[i];
-            break;
+            fsck_problem(state, &state->report->bad_chains, "%s: cluster chain loops at cluster %u", path,
+                         cluster);
+            return -1;
         }
+        fsck_problem(state, &state->report->cross_linked, "%s: cluster %u also belongs to another file", path,
+                     cluster);
+        return 1;
     }
-    if (file == NULL)
+
+    uint32_t bit = cluster - 2;
+    if (alloc_bitmap && !(alloc_bitmap[bit / 64] & (UINT64_C(1) << (bit % 64))))
     {
-        return -1; // The file is not open.
+        fsck_problem(state, &state->report->unallocated, "%s: cluster %u is free in the allocation bitmap", path,
+                     cluster);
     }
+    return 0;
+}
 
-    // If we have reached or passed the end of the file, return 0 (EOF).
-    if (file->offset >= file->file_size)
+/**
+ * Walk and claim the chain of a file or directory, and check that its
+ * length agrees with `size` (unless `check_size` is 0).
+ * Return: the number of clusters in the chain, or -1 if it is broken.
+ */
+static int64_t fsck_chain(fsck_state *state, uint32_t first_cluster, uint64_t size, int no_fat_chain,
+                          int check_size, const char *path)
+{
+    uint32_t cluster_size = bytes_per_cluster();
+    uint64_t expected = (size + cluster_size - 1) / cluster_size;
+    uint32_t id = __atomic_add_fetch(&state->next_id, 1, __ATOMIC_RELAXED);
+
+    if (first_cluster == 0)
     {
+        if (check_size && expected != 0)
+        {
+            fsck_problem(state, &state->report->bad_lengths, "%s: %lu bytes but no clusters", path,
+                         (unsigned long)size);
+        }
         return 0;
     }
-
-    // Do not try to read beyond the file's end.
-    if (count > file->file_size - file->offset)
+    if (first_cluster < 2 || first_cluster >= fat_entries)
     {
-        count = file->file_size - file->offset;
+        fsck_problem(state, &state->report->bad_chains, "%s: first cluster %u is outside the cluster heap", path,
+                     first_cluster);
+        return -1;
     }
 
-    // Calculate the size of a cluster.
-    uint32_t cluster_size = (1 << mbr.bytes_per_sector_shift) *
-                            (1 << mbr.sectors_per_cluster_shift);
-
-    // Allocate a temporary buffer for one cluster.
-    uint8_t *cluster_buffer = malloc(cluster_size);
-    if (!cluster_buffer)
+    if (no_fat_chain)
     {
-        return -1; // Memory allocation failure.
+        // One contiguous run; the FAT entries mean nothing.
+        if (first_cluster + expected > fat_entries)
+        {
+            fsck_problem(state, &state->report->bad_chains, "%s: contiguous run runs past the cluster heap", path);
+            return -1;
+        }
+        for (uint64_t i = 0; i < expected; i++)
+        {
+            if (fsck_claim(state, first_cluster + i, id, path) != 0)
+            {
+                return -1; // The rest belongs to (or overlaps) another file
+            }
+        }
+        return expected;
     }
 
-    size_t total_bytes_read = 0;  // Total bytes read so far.
-    size_t bytes_to_read = count; // Bytes still needed to read.
-
-    // Determine the starting point: which cluster and what offset in that cluster.
-    size_t starting_offset = file->offset;
-    uint32_t current_cluster = file->start_cluster;
-    uint32_t clusters_to_skip = starting_offset / cluster_size;
-    size_t offset_in_cluster = starting_offset % cluster_size;
-
-    // Skip clusters that come entirely before the current offset.
-    for (uint32_t i = 0; i < clusters_to_skip; i++)
+    int64_t length = 0;
+    uint32_t cluster = first_cluster;
+    while (1)
     {
-        uint64_t fat_entry_offset = (mbr.fat_offset * (1 << mbr.bytes_per_sector_shift)) +
-                                    (current_cluster * sizeof(uint32_t));
-        fseek(fs_image, fat_entry_offset, SEEK_SET);
-        if (fread(&current_cluster, sizeof(uint32_t), 1, fs_image) != 1)
+        // Running into another chain stops the walk (see fsck_claim), so
+        // this only guards against a corrupt FAT longer than the heap.
+        if (++length > (int64_t)mbr.cluster_count)
         {
-            free(cluster_buffer);
+            fsck_problem(state, &state->report->bad_chains, "%s: cluster chain does not end", path);
             return -1;
         }
-        if (current_cluster == 0xFFFFFFFF)
-        { // Reached end-of-file chain prematurely.
-            free(cluster_buffer);
-            return total_bytes_read;
+        if (fsck_claim(state, cluster, id, path) != 0)
+        {
+            return -1; // Looped, or ran into another file's chain
         }
-    }
 
-    // Now, read cluster-by-cluster.
-    while (bytes_to_read > 0 && current_cluster != 0xFFFFFFFF)
-    {
-        // Calculate the absolute offset of the current cluster in the file system image.
-        uint64_t cluster_addr = (mbr.cluster_heap_offset * (1 << mbr.bytes_per_sector_shift)) +
-                                ((current_cluster - 2) * cluster_size);
-        fseek(fs_image, cluster_addr, SEEK_SET);
-        if (fread(cluster_buffer, cluster_size, 1, fs_image) != 1)
+        uint32_t next = fat_cache[cluster];
+        if (next == 0xFFFFFFFF)
         {
-            free(cluster_buffer);
+            break;
+        }
+        if (next < 2 || next >= fat_entries)
+        {
+            fsck_problem(state, &state->report->bad_chains, "%s: chain ends at cluster %u without an end mark",
+                         path, cluster);
             return -1;
         }
+        cluster = next;
+    }
 
-        // Determine how many bytes are available in the current cluster.
-        size_t available_in_cluster = cluster_size - offset_in_cluster;
-        size_t bytes_from_cluster = (bytes_to_read < available_in_cluster) ? bytes_to_read : available_in_cluster;
+    if (check_size && (uint64_t)length != expected)
+    {
+        fsck_problem(state, &state->report->bad_lengths, "%s: %lu bytes but %ld clusters", path,
+                     (unsigned long)size, (long)length);
+    }
+    return length;
+}
 
-        // Copy the bytes from the cluster into the caller's buffer.
-        memcpy((char *)buffer + total_bytes_read, cluster_buffer + offset_in_cluster, bytes_from_cluster);
+/**
+ * Queue a directory for the worker threads. The caller holds state->lock.
+ */
+static void fsck_queue(fsck_state *state, fsck_directory *dir)
+{
+    dir->next = state->queue;
+    state->queue = dir;
+    state->pending++;
+    pthread_cond_signal(&state->ready);
+}
 
-        total_bytes_read += bytes_from_cluster;
-        bytes_to_read -= bytes_from_cluster;
-        // Update the file's offset.
-        file->offset += bytes_from_cluster;
+/**
+ * Make a queue item for the directory at `path`.
+ */
+static fsck_directory *fsck_directory_new(const char *path, uint32_t first_cluster, uint64_t size,
+                                          int no_fat_chain)
+{
+    size_t length = strlen(path);
+    fsck_directory *dir = malloc(sizeof(fsck_directory) + length + 1);
+    if (!dir)
+        return NULL;
+    dir->first_cluster = first_cluster;
+    dir->size = size;
+    dir->no_fat_chain = no_fat_chain;
+    dir->is_root = 0;
+    memcpy(dir->path, path, length + 1);
+    return dir;
+}
 
-        // After the first cluster, subsequent clusters start reading at offset 0.
-        offset_in_cluster = 0;
+/**
+ * Check one complete entry set: its checksum, and the chain of the file or
+ * directory it describes. Subdirectories are queued.
+ */
+static void fsck_entry_set(fsck_state *state, const fsck_directory *dir, const directory_entry *set, int entries)
+{
+    nqp_fsck_report *report = state->report;
 
-        if (bytes_to_read > 0)
-        {
-            // Follow the FAT chain to the next cluster.
-            uint64_t fat_entry_offset = (mbr.fat_offset * (1 << mbr.bytes_per_sector_shift)) +
-                                        (current_cluster * sizeof(uint32_t));
-            fseek(fs_image, fat_entry_offset, SEEK_SET);
-            if (fread(&current_cluster, sizeof(uint32_t), 1, fs_image) != 1)
-            {
-                free(cluster_buffer);
-                return -1;
-            }
-        }
+    // Name, for messages and for the paths of subdirectories.
+    char name[MAX_NAME_UTF8 + 1] = "";
+    if (entries >= 2 && set[1].entry_type == DENTRY_TYPE_STREAM_EXTENSION)
+    {
+        int name_entries = 2;
+        while (name_entries < entries && set[name_entries].entry_type == DENTRY_TYPE_FILE_NAME)
+            name_entries++;
+        set_name_utf8(set, name_entries, name);
     }
 
-    free(cluster_buffer);
-    return total_bytes_read; // Return the number of bytes read.
-}
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir->is_root ? "" : dir->path, name);
 
-ssize_t nqp_getdents(int fd, void *dirp, size_t count)
-{
-    // Here, 'count' is the number of nqp_dirent entries to read.
-    if (!is_mounted || fd < 2 || !dirp || count < 1)
+    const uint8_t *bytes = (const uint8_t *)set;
+    uint16_t checksum = 0;
+    for (size_t i = 0; i < (size_t)entries * sizeof(directory_entry); i++)
     {
-        return -1;
+        if (i == 2 || i == 3)
+            continue; // SetChecksum itself
+        checksum = ((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + bytes[i];
+    }
+    if (checksum != set[0].file.set_checksum)
+    {
+        fsck_problem(state, &report->bad_checksums, "%s: entry set checksum is %04x, should be %04x", path,
+                     set[0].file.set_checksum, checksum);
     }
 
-    // We'll only support count == 1 (i.e. one entry per call) for this simple ls.
-    // Use static variables to keep track of our directory reading state.
-    static uint32_t current_cluster = 0;
-    static size_t current_index = 0;
-    static int state_initialized = 0;
+    if (entries < 2 || set[1].entry_type != DENTRY_TYPE_STREAM_EXTENSION ||
+        (size_t)(entries - 2) * 15 < set[1].stream_extension.name_length)
+    {
+        fsck_problem(state, &report->bad_entries, "%s: entry set is missing its stream or name entries", path);
+        return;
+    }
 
-    // If state is not yet initialized (or if this is the first call for this directory),
-    // initialize with the starting cluster (which is passed as fd) and reset index.
-    if (!state_initialized)
+    const stream_extension *stream = &set[1].stream_extension;
+    if (set[0].file.file_attributes & 0x10)
+    {
+        __atomic_add_fetch(&report->directories, 1, __ATOMIC_RELAXED);
+        fsck_directory *child = fsck_directory_new(path, stream->first_cluster, stream->data_length,
+                                                   stream->flags.no_fat_chain);
+        if (!child)
+        {
+            fsck_problem(state, &report->unreadable, "%s: out of memory", path);
+            return;
+        }
+        pthread_mutex_lock(&state->lock);
+        fsck_queue(state, child);
+        pthread_mutex_unlock(&state->lock);
+    }
+    else
     {
-        current_cluster = fd;
-        current_index = 0;
-        state_initialized = 1;
+        __atomic_add_fetch(&report->files, 1, __ATOMIC_RELAXED);
+        fsck_chain(state, stream->first_cluster, stream->data_length, stream->flags.no_fat_chain, 1, path);
     }
+}
 
-    // Allocate a temporary buffer to read one cluster.
-    uint32_t cluster_size = (1 << mbr.bytes_per_sector_shift) * (1 << mbr.sectors_per_cluster_shift);
-    uint8_t *cluster_buffer = malloc(cluster_size);
-    if (!cluster_buffer)
+/**
+ * Check a directory: its own chain, then every entry in it. Entry sets may
+ * straddle clusters, so each set is gathered before it is checked.
+ */
+static void fsck_check_directory(fsck_state *state, const fsck_directory *dir)
+{
+    int64_t clusters = fsck_chain(state, dir->first_cluster, dir->size, dir->no_fat_chain, !dir->is_root, dir->path);
+    if (clusters <= 0)
     {
-        return -1;
+        return; // Broken (already reported) or empty
     }
 
-    nqp_dirent *result_entry = (nqp_dirent *)dirp; // This is where we'll store the one entry to return.
-    int found = 0;
+    size_t cluster_size = bytes_per_cluster();
+    uint8_t *scratch = fs_map ? NULL : malloc(cluster_size);
+    directory_entry *set = malloc(FSCK_MAX_SET * sizeof(directory_entry));
+    if ((!fs_map && !scratch) || !set)
+    {
+        fsck_problem(state, &state->report->unreadable, "%s: out of memory", dir->path);
+        free(scratch);
+        free(set);
+        return;
+    }
 
-    // Loop until we find one valid directory entry or we reach the end.
-    while (!found && current_cluster != 0xFFFFFFFF)
+    int collected = 0;
+    int wanted = 0;
+    int done = 0;
+    uint32_t cluster = dir->first_cluster;
+    for (int64_t index = 0; index < clusters && !done; index++)
     {
-        // Compute the byte offset for the current cluster.
-        uint64_t cluster_offset = (mbr.cluster_heap_offset * (1 << mbr.bytes_per_sector_shift)) +
-                                  (current_cluster - 2) * cluster_size;
-        fseek(fs_image, cluster_offset, SEEK_SET);
-        if (fread(cluster_buffer, cluster_size, 1, fs_image) != 1)
+        const directory_entry *entry = (const directory_entry *)cluster_data(cluster, scratch);
+        if (!entry)
         {
-            free(cluster_buffer);
-            return -1; // Error reading from the file system.
+            fsck_problem(state, &state->report->unreadable, "%s: could not read cluster %u", dir->path, cluster);
+            break;
         }
 
-        size_t num_entries = cluster_size / sizeof(directory_entry);
-        directory_entry *entries = (directory_entry *)cluster_buffer;
-
-        // Iterate over the entries in this cluster, starting at current_index.
-        for (size_t i = current_index; i < num_entries; i++)
+        for (size_t i = 0; i < cluster_size / sizeof(directory_entry); i++)
         {
-            // If we encounter an end-of-directory marker, we're done.
-            if (entries[i].entry_type == DENTRY_TYPE_END)
+            uint8_t type = entry[i].entry_type;
+            if (collected > 0)
             {
-                // Reset state for next directory read.
-                state_initialized = 0;
-                free(cluster_buffer);
-                return 0;
+                if (type >= 0xC0)
+                {
+                    set[collected++] = entry[i];
+                    if (collected == wanted)
+                    {
+                        fsck_entry_set(state, dir, set, collected);
+                        collected = 0;
+                    }
+                    continue;
+                }
+                // The set ended early; check what there is.
+                fsck_entry_set(state, dir, set, collected);
+                collected = 0;
             }
 
-            // Look for a valid entry set starting with a FILE entry.
-            if (entries[i].entry_type == DENTRY_TYPE_FILE)
+            if (type == DENTRY_TYPE_END)
             {
-                // Check that the next two entries exist.
-                if (i + 2 >= num_entries)
-                    break; // Not enough entries in this cluster; we'll fetch the next cluster.
-
-                // Verify that we have a STREAM_EXTENSION and a FILE_NAME following.
-                if (entries[i + 1].entry_type != DENTRY_TYPE_STREAM_EXTENSION ||
-                    entries[i + 2].entry_type != DENTRY_TYPE_FILE_NAME)
+                done = 1;
+                break;
+            }
+            if (type == DENTRY_TYPE_FILE)
+            {
+                set[collected++] = entry[i];
+                wanted = 1 + entry[i].file.secondary_count;
+                if (collected == wanted)
                 {
-                    continue; // Not a valid entry set; skip.
+                    fsck_entry_set(state, dir, set, collected);
+                    collected = 0;
                 }
+            }
+            else if (dir->is_root && type == DENTRY_TYPE_ALLOCATION_BITMAP)
+            {
+                fsck_chain(state, entry[i].bitmap.first_cluster, entry[i].bitmap.data_length, 0, 1,
+                           "allocation bitmap");
+            }
+            else if (dir->is_root && type == DENTRY_TYPE_UP_CASE_TABLE)
+            {
+                fsck_chain(state, entry[i].up_case.first_cluster, entry[i].up_case.data_length, 0, 1,
+                           "up-case table");
+            }
+        }
 
-                // Convert the Unicode file name (15 uint16_t characters) to ASCII.
-                char *ascii_name = unicode2ascii(entries[i + 2].file_name.file_name, 15);
-                if (!ascii_name)
-                    continue;
+        cluster = dir->no_fat_chain ? cluster + 1 : fat_cache[cluster];
+    }
+    if (collected > 0)
+    {
+        fsck_entry_set(state, dir, set, collected);
+    }
 
-                // Populate the nqp_dirent structure.
-                result_entry->inode_number = entries[i + 1].stream_extension.first_cluster;
-                result_entry->name = ascii_name;
-                result_entry->name_len = strlen(ascii_name);
-                // Use a flag (here 0x10) to indicate a directory—adjust as needed.
-                if (entries[i].file.file_attributes & 0x10)
-                {
-                    result_entry->type = DT_DIR;
-                }
-                else
-                {
-                    result_entry->type = DT_REG;
-                }
+    free(scratch);
+    free(set);
+}
 
-                // Update our state: advance the index beyond the processed entry set.
-                current_index = i + 3;
-                found = 1;
-                break;
-            }
+/**
+ * Worker thread: check queued directories until there are none left and
+ * none being checked (which could queue more).
+ */
+static void *fsck_worker(void *arg)
+{
+    fsck_state *state = arg;
+
+    pthread_mutex_lock(&state->lock);
+    while (1)
+    {
+        while (!state->queue && state->pending > 0)
+        {
+            pthread_cond_wait(&state->ready, &state->lock);
+        }
+        if (!state->queue)
+        {
+            break; // pending is 0: everything has been checked
+        }
+
+        fsck_directory *dir = state->queue;
+        state->queue = dir->next;
+        pthread_mutex_unlock(&state->lock);
+
+        fsck_check_directory(state, dir);
+        free(dir);
+
+        pthread_mutex_lock(&state->lock);
+        if (--state->pending == 0)
+        {
+            pthread_cond_broadcast(&state->ready);
         }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
 
-        if (!found)
+/**
+ * Find clusters marked allocated in the bitmap that no chain reached.
+ */
+static void fsck_lost_clusters(fsck_state *state)
+{
+    for (size_t w = 0; w < alloc_bitmap_words; w++)
+    {
+        uint64_t word = alloc_bitmap[w];
+        while (word)
         {
-            // We did not find a valid entry in this cluster.
-            // Reset current_index for the next cluster.
-            current_index = 0;
-            // Read the FAT entry to get the next cluster in the directory chain.
-            uint64_t fat_entry_offset = (mbr.fat_offset * (1 << mbr.bytes_per_sector_shift)) +
-                                        (current_cluster * sizeof(uint32_t));
-            fseek(fs_image, fat_entry_offset, SEEK_SET);
-            if (fread(&current_cluster, sizeof(uint32_t), 1, fs_image) != 1)
+            uint32_t cluster = w * 64 + __builtin_ctzll(word) + 2;
+            word &= word - 1;
+            if (state->owner[cluster] == 0)
             {
-                free(cluster_buffer);
-                return -1;
+                fsck_problem(state, &state->report->lost_clusters,
+                             "cluster %u is allocated but not part of any file", cluster);
             }
         }
     }
-
-    free(cluster_buffer);
-    if (found)
-        return sizeof(nqp_dirent); // Return the number of bytes (one entry).
-    else
-        return 0;
 }
 
-// Problems :
-
-// 1. Problems while accessing/ opening/ reading Nested Files -- Fix it -- Problem Fixed
-// Above Problem is with not having the appropriate file extensions -- properly name ur files like .md or .txt extensions
-
-// Problems wiht this function -- Better idea to implement an OFT
-// This function is trash -- come back to this
-int nqp_size(int fd)
+/**
+ * Check the mounted volume for consistency (see nqp_io.h).
+ */
+int nqp_fsck(nqp_fsck_report *report, unsigned threads)
 {
-    if (fd < 2) // Invalid file descriptor (should be a valid cluster number)
+    if (!is_mounted || !report)
     {
         return -1;
     }
+    memset(report, 0, sizeof(*report));
 
-    // Compute cluster size in bytes
-    uint32_t cluster_size = (1 << mbr.bytes_per_sector_shift) * (1 << mbr.sectors_per_cluster_shift);
-
-    // Allocate buffer for directory reading
-    uint8_t *cluster_buffer = malloc(cluster_size);
-    if (!cluster_buffer)
+    if (threads == 0)
     {
-        return -1;
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    if (threads > 64)
+    {
+        threads = 64;
     }
 
-    // Locate Root Directory Cluster
-    uint32_t root_cluster = mbr.first_cluster_of_root_directory;
-    uint32_t cluster_offset = mbr.cluster_heap_offset * (1 << mbr.bytes_per_sector_shift);
-    uint64_t cluster_address = cluster_offset + (root_cluster - 2) * cluster_size;
-
-    // Seek to the Root Directory
-    if (fseek(fs_image, cluster_address, SEEK_SET) != 0)
+    fsck_state state = {.report = report};
+    state.owner = calloc(fat_entries, sizeof(uint32_t));
+    fsck_directory *root = fsck_directory_new("/", mbr.first_cluster_of_root_directory, 0, 0);
+    if (!state.owner || !root)
     {
-        perror("Error seeking to root directory cluster");
-        free(cluster_buffer);
+        free(state.owner);
+        free(root);
         return -1;
     }
+    root->is_root = 1;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.ready, NULL);
+    report->directories = 1;
+    fsck_queue(&state, root);
+
+    pthread_t workers[64];
+    unsigned started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, fsck_worker, &state) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        fsck_worker(&state); // No threads to be had: check on this one
+    }
+    for (unsigned i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
 
-    // Read the Directory Cluster
-    size_t bytes_read = fread(cluster_buffer, 1, cluster_size, fs_image);
-    if (bytes_read != cluster_size)
+    if (alloc_bitmap)
     {
-        perror("Error reading root directory cluster");
-        free(cluster_buffer);
-        return -1;
+        fsck_lost_clusters(&state);
+    }
+    else
+    {
+        fsck_problem(&state, &report->bad_entries, "the volume has no allocation bitmap");
     }
 
-    // Scan Directory Entries for the File
-    directory_entry *entry = (directory_entry *)cluster_buffer;
-    stream_extension *stream_ext = NULL;
+    pthread_cond_destroy(&state.ready);
+    pthread_mutex_destroy(&state.lock);
+    free(state.owner);
 
-    for (size_t i = 0; i < cluster_size / sizeof(directory_entry); i++)
-    {
-        if (entry[i].entry_type == DENTRY_TYPE_FILE) // Found a file entry
-        {
-            // The Stream Extension entry follows immediately
-            stream_ext = (stream_extension *)&entry[i + 1];
+    report->problems = report->bad_chains + report->unallocated + report->cross_linked + report->bad_lengths +
+                       report->bad_checksums + report->bad_entries + report->lost_clusters + report->unreadable;
+    return report->problems == 0 ? 0 : 1;
+}
 
-            // Check if this file's first cluster matches `fd`
-            if (stream_ext->first_cluster == (uint32_t)fd)
-            {
-                // Found the correct file, extract file size
-                uint64_t file_size = stream_ext->data_length;
+// Problems :
 
-                // Check for integer overflow
-                if (file_size > INT_MAX)
-                {
-                    fprintf(stderr, "Error: File size exceeds integer limit\n");
-                    free(cluster_buffer);
-                    return -1;
-                }
+// 1. Problems while accessing/ opening/ reading Nested Files -- Fix it -- Problem Fixed
+// Above Problem is with not having the appropriate file extensions -- properly name ur files like .md or .txt extensions
 
-                free(cluster_buffer);
-                return (int)file_size; // Return file size as an int
-            }
-        }
+// Size of an open file, straight from the OFT.
+int nqp_size(int fd)
+{
+    open_file_entry *file = lock_open_file(fd);
+    if (file == NULL)
+    {
+        return -1;
     }
+    uint64_t file_size = file->file_size;
+    pthread_mutex_unlock(&file->lock);
 
-    // If no matching file was found
-    fprintf(stderr, "Error: File with cluster %d not found\n", fd);
-    free(cluster_buffer);
-    return -1;
+    // Check for integer overflow
+    if (file_size > INT_MAX)
+    {
+        fprintf(stderr, "Error: File size exceeds integer limit\n");
+        return -1;
+    }
+    return (int)file_size; // Return file size as an int
 }
 
 // Function that Prints the Open File Table :
 void print_open_file_table(void)
 {
     printf("Open File Table:\n");
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
+    int slots = __atomic_load_n(&fd_chunk_count, __ATOMIC_ACQUIRE) << FD_CHUNK_SHIFT;
+    for (int i = 0; i < slots; i++)
     {
-        if (open_files[i].in_use)
+        open_file_entry *file = fd_entry(i);
+        if (__atomic_load_n(&file->state, __ATOMIC_ACQUIRE) == SLOT_OPEN)
         {
             printf("Slot %d: IN USE\n", i);
-            printf("   Start Cluster: %u\n", open_files[i].start_cluster);
-            printf("   File Size: %llu bytes\n", (unsigned long long)open_files[i].file_size);
-            printf("   Current Offset: %llu bytes\n", (unsigned long long)open_files[i].offset);
+            printf("   Start Cluster: %u\n", file->start_cluster);
+            printf("   File Size: %llu bytes\n", (unsigned long long)file->file_size);
+            printf("   Current Offset: %llu bytes\n", (unsigned long long)file->offset);
         }
         else
         {
@@ -661,15 +3442,7 @@ void print_open_file_table(void)
 // Function that returns File using using FD
 int FileSize(int FD)
 {
-    for (int i = 0; i < MAX_OPEN_FILES; i++)
-    {
-        if (open_files[i].start_cluster == (uint32_t)FD)
-        {
-            return open_files[i].file_size;
-            break;
-        }
-    }
-    return -1;
+    return nqp_size(FD);
 }
 
 // Birds of the Feather
@@ -112,18 +112,31 @@ typedef struct FILE_NAME
 } file_name;
 #pragma pack(pop)
 
-// Tracks which clusters are allocated or
-
+// Locates the allocation bitmap, which has one bit per cluster in the
+// cluster heap (set if the cluster is allocated)
 #pragma pack(push, 1)
 typedef struct ALLOCATION_BITMAP
 {
-    uint8_t bitmap_flaJgs;
+    uint8_t bitmap_flags; // bit 0: which FAT this bitmap goes with (TexFAT only)
     uint8_t reserved[18];
     uint32_t first_cluster;
     uint64_t data_length;
 } allocation_bitmap;
 #pragma pack(pop)
 
+// Locates the up-case table, which maps each UTF-16 code unit to its upper
+// case form (used for name hashes and case-insensitive name comparison)
+#pragma pack(push, 1)
+typedef struct UP_CASE_TABLE
+{
+    uint8_t reserved1[3];
+    uint32_t table_checksum;
+    uint8_t reserved2[12];
+    uint32_t first_cluster;
+    uint64_t data_length;
+} up_case_table;
+#pragma pack(pop)
+
 // Represents the label of the file system
 #pragma pack(push, 1)
 typedef struct VOLUME_LABEL
@@ -143,6 +156,7 @@ typedef struct DIRECTORY_ENTRY
     union
     {
         allocation_bitmap bitmap;
+        up_case_table up_case;
         volume_label label;
         file_dentry file;
         file_name file_name;
@@ -1,12 +1,19 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-#define MAX_OPEN_FILES 8
+// There is no fixed MAX_OPEN_FILES: the open file table grows as needed, up
+// to 65536 descriptors.
 
 // Your job is to implement the interface defined in the header file nqp_io.h.
 // This interface describes a read-only interface for a file system, similar to POSIX (but not quite).
+//
+// Once a volume is mounted every call below may be made from many threads at
+// once. Each descriptor has its own offset, and calls on the same descriptor
+// are serialised. nqp_mount and nqp_unmount must not race with anything else.
 
 typedef enum NQP_FS_TYPE
 {
@@ -17,6 +24,15 @@ typedef enum NQP_FS_TYPE
     NQP_FS_TYPES // Placeholder for additional file system types.
 } nqp_fs_type;
 
+// Backend selection for nqp_mount_with().
+typedef enum NQP_MOUNT_FLAGS
+{
+    NQP_MOUNT_DEFAULT = 0,     // read the volume with positioned reads (pread)
+    NQP_MOUNT_MMAP = 1 << 0,   // map the whole volume into memory
+    NQP_MOUNT_FSCK = 1 << 1,   // run nqp_fsck() and refuse volumes that fail it
+    NQP_MOUNT_TIMING = 1 << 2, // time nqp_open, read and getdents calls for nqp_stats()
+} nqp_mount_flags;
+
 typedef enum NQP_DIRECTORY_ENTRY_TYPE
 {
     DT_DIR, // a directory
@@ -27,11 +43,131 @@ typedef enum NQP_DIRECTORY_ENTRY_TYPE
 typedef struct NQP_DIRECTORY_ENTRY
 {
     uint64_t inode_number; // the unique identifier for this entry
-    size_t name_len;       // the number of characters in the name
-    char *name;            // the actual name
+    size_t name_len;       // the length of the name in bytes
+    char *name;            // the actual name, in UTF-8
     nqp_dtype type;        // the type of file that this points at
 } nqp_dirent;
 
+// Record written by nqp_getdents64(), modelled on Linux's linux_dirent64.
+// Records are packed back to back; each one is record_length bytes long
+// (the name plus padding to keep the next record 8-byte aligned).
+typedef struct NQP_DIRECTORY_ENTRY64
+{
+    uint64_t inode_number;  // the unique identifier for this entry
+    uint16_t record_length; // offset from this record to the next one
+    uint16_t name_len;      // the length of the name in bytes
+    uint8_t type;           // nqp_dtype of the entry
+    char name[];            // the name, NUL-terminated
+} nqp_dirent64;
+
+// Size of the nqp_dirent64 record holding a name of name_len bytes.
+#define NQP_DIRENT64_RECLEN(name_len) \
+    ((offsetof(nqp_dirent64, name) + (name_len) + 1 + 7) & ~(size_t)7)
+
+// exFAT file attribute bits (nqp_stat.attributes).
+#define NQP_ATTR_READ_ONLY 0x01
+#define NQP_ATTR_HIDDEN 0x02
+#define NQP_ATTR_SYSTEM 0x04
+#define NQP_ATTR_DIRECTORY 0x10
+#define NQP_ATTR_ARCHIVE 0x20
+
+// Metadata of a file or directory, from its directory entry set, filled in by
+// nqp_getdents_stat(). Timestamps are in the exFAT packed format: seconds / 2
+// in bits 0-4, minutes 5-10, hours 11-15, day 16-20, month 21-24 and years
+// since 1980 in bits 25-31.
+typedef struct NQP_STAT
+{
+    uint64_t size;               // data length in bytes
+    uint32_t first_cluster;      // first cluster of the data (0 if empty)
+    uint16_t attributes;         // NQP_ATTR_* bits
+    uint8_t no_fat_chain;        // the data is one contiguous run of clusters
+    uint32_t create_timestamp;   // when the file was created
+    uint32_t modified_timestamp; // when the file was last modified
+    uint32_t accessed_timestamp; // when the file was last accessed
+} nqp_stat;
+
+// Free space on the mounted volume, from nqp_statfs().
+typedef struct NQP_STATFS_INFO
+{
+    uint32_t cluster_size;     // bytes per cluster
+    uint32_t total_clusters;   // clusters in the cluster heap
+    uint32_t used_clusters;    // clusters marked allocated
+    uint32_t free_clusters;    // clusters marked free
+    uint32_t free_runs;        // stretches of consecutive free clusters
+    uint32_t largest_free_run; // clusters in the longest stretch
+    uint32_t fragmentation;    // free space fragmentation in per mille: 0 when the
+                               // free space is one run, nearing 1000 as it
+                               // breaks up into single clusters
+} nqp_statfs_info;
+
+// Number of problem descriptions kept in an nqp_fsck_report.
+#define NQP_FSCK_MESSAGES 8
+
+// What nqp_fsck() found. Each counter is a number of problems of one kind.
+typedef struct NQP_FSCK_REPORT
+{
+    size_t files;       // regular files checked
+    size_t directories; // directories checked, the root included
+
+    size_t bad_chains;    // chains that loop, leave the heap or have no end mark
+    size_t unallocated;   // chain clusters marked free in the allocation bitmap
+    size_t cross_linked;  // clusters reached from more than one chain
+    size_t bad_lengths;   // files and directories whose size doesn't match their chain
+    size_t bad_checksums; // entry sets with the wrong SetChecksum
+    size_t bad_entries;   // malformed entry sets, or no allocation bitmap
+    size_t lost_clusters; // clusters marked allocated that no chain reaches
+    size_t unreadable;    // directory clusters that couldn't be read
+    size_t problems;      // all of the above
+
+    size_t message_count;                   // descriptions stored in messages
+    char messages[NQP_FSCK_MESSAGES][160]; // the first problems found
+} nqp_fsck_report;
+
+// Default number of clusters in the cluster cache (see nqp_set_cache_size).
+#define NQP_CACHE_DEFAULT_CLUSTERS 1024
+
+// Cluster cache size and counters, from nqp_get_cache_info().
+typedef struct NQP_CACHE_INFO
+{
+    size_t capacity;    // clusters the cache can hold (0: cache is off)
+    uint64_t hits;      // cluster reads served from the cache
+    uint64_t misses;    // cluster reads that went to the volume
+    uint64_t evictions; // clusters dropped to make room
+} nqp_cache_info;
+
+// Latency histogram buckets: bucket 0 counts calls under 256 ns, bucket i
+// calls from 2^(i+7) up to 2^(i+8) ns, and the last bucket everything slower.
+#define NQP_LATENCY_BUCKETS 20
+
+// How many calls of one kind were made and, if the volume was mounted with
+// NQP_MOUNT_TIMING, how long they took.
+typedef struct NQP_LATENCY
+{
+    uint64_t calls;
+    uint64_t timed_calls; // calls counted in total_ns and buckets
+    uint64_t total_ns;
+    uint64_t buckets[NQP_LATENCY_BUCKETS];
+} nqp_latency;
+
+// What the read path has done, from nqp_stats(). Every field is a count
+// since the last reset.
+typedef struct NQP_STATS
+{
+    uint64_t device_reads;         // reads from the volume (memcpy from the mapping with NQP_MOUNT_MMAP)
+    uint64_t device_read_bytes;    // bytes those reads returned
+    uint64_t fat_lookups;          // FAT entries followed
+    uint64_t dir_clusters_scanned; // directory clusters looked through by nqp_open and getdents
+    uint64_t name_conversions;     // file names converted from UTF-16
+    uint64_t name_allocations;     // of those, names that were malloc()ed
+    uint64_t cache_hits;           // cluster cache hits
+    uint64_t cache_misses;         // cluster cache misses
+    uint64_t dcache_hits;          // path prefixes found in the dentry cache (negative entries included)
+    uint64_t dcache_misses;        // path prefixes that had to be looked up
+    nqp_latency open;              // nqp_open
+    nqp_latency read;              // nqp_read, nqp_pread and nqp_preadv
+    nqp_latency getdents;          // every nqp_getdents variant
+} nqp_stats_info;
+
 typedef enum NQP_ERROR
 {
     NQP_OK = 0, // no error.
@@ -67,6 +203,22 @@ typedef enum NQP_ERROR
  */
 nqp_error nqp_mount(const char *source, nqp_fs_type fs_type);
 
+/**
+ * "Mount" a file system, choosing how the volume is accessed.
+ *
+ * nqp_mount() is nqp_mount_with(source, fs_type, NQP_MOUNT_DEFAULT). With
+ * NQP_MOUNT_MMAP the whole volume is mapped read-only: directory entries are
+ * parsed in place and nqp_read becomes a bounded memcpy out of the mapping.
+ *
+ * Parameters:
+ *  * source: The file containing the file system to mount. Must not be NULL.
+ *  * fs_type: The type of the file system. Must be a value from nqp_fs_type.
+ *  * flags: A combination of values from nqp_mount_flags.
+ * Return: As nqp_mount(). NQP_INVAL is also returned if the volume can't be
+ *         mapped.
+ */
+nqp_error nqp_mount_with(const char *source, nqp_fs_type fs_type, int flags);
+
 /**
  * "Unmount" the mounted file system.
  *
@@ -81,6 +233,9 @@ nqp_error nqp_unmount(void);
 /**
  * Open the file at pathname in the "mounted" file system.
  *
+ * Paths are UTF-8. Names are compared without regard to case, using the
+ * volume's up-case table, as exFAT does: "/readme.TXT" opens "/README.txt".
+ *
  * Parameters:
  *  * pathname: The path of the file or directory in the file system that
  *              should be opened.  Must not be NULL.
@@ -110,6 +265,136 @@ int nqp_close(int fd);
  */
 ssize_t nqp_read(int fd, void *buffer, size_t count);
 
+/**
+ * Read from a file at a given offset, like pread(2).
+ *
+ * The descriptor's offset is neither used nor changed, so any number of
+ * threads can read the same descriptor at once without coordinating.
+ * Clusters that are next to each other on disk are read with one request.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to read from. Must be a nonnegative integer. The
+ *        file descriptor should refer to a file, not a directory.
+ *  * buffer: The buffer to read data into. Must not be NULL.
+ *  * count: The number of bytes to read into the buffer.
+ *  * offset: Where in the file to start reading. Must not be negative.
+ * Return: The number of bytes read, 0 at or past the end of the file, or -1
+ *         on error.
+ */
+ssize_t nqp_pread(int fd, void *buffer, size_t count, off_t offset);
+
+/**
+ * Read from a file at a given offset into several buffers, like preadv(2).
+ *
+ * The buffers are filled in order, as if they were one buffer; as with
+ * nqp_pread the descriptor's offset is left alone.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to read from. Must be a nonnegative integer. The
+ *        file descriptor should refer to a file, not a directory.
+ *  * iov: The buffers to read data into. Must not be NULL.
+ *  * iovcnt: The number of buffers, at most IOV_MAX.
+ *  * offset: Where in the file to start reading. Must not be negative.
+ * Return: The total number of bytes read, 0 at or past the end of the file,
+ *         or -1 on error.
+ */
+ssize_t nqp_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+/**
+ * Set how many clusters the next nqp_mount keeps in its cluster cache.
+ *
+ * The cache holds directory clusters and clusters of files that are read in
+ * pieces smaller than a cluster, so repeated lookups, listings and small
+ * reads of the same data don't go back to the volume. It is limited to 64 MB
+ * whatever the cluster size, and the mapped backend (NQP_MOUNT_MMAP) doesn't
+ * use it. Has no effect on a volume that is already mounted.
+ *
+ * Parameters:
+ *  * clusters: The number of clusters to cache; 0 turns the cache off.
+ *              Defaults to NQP_CACHE_DEFAULT_CLUSTERS.
+ */
+void nqp_set_cache_size(size_t clusters);
+
+/**
+ * Get the cluster cache's capacity and hit, miss and eviction counts since
+ * the volume was mounted.
+ *
+ * Parameters:
+ *  * info: Where to store the numbers. Must not be NULL.
+ * Return: 0 on success or -1 on error (e.g., no volume is mounted).
+ */
+int nqp_get_cache_info(nqp_cache_info *info);
+
+/**
+ * Get the used and free space of the mounted volume, like statfs(2).
+ *
+ * The figures come from the volume's allocation bitmap, which is loaded and
+ * summarised when the volume is mounted, so this doesn't read the volume or
+ * walk any directories.
+ *
+ * Parameters:
+ *  * info: Where to store the numbers. Must not be NULL.
+ * Return: 0 on success or -1 on error (e.g., no volume is mounted, or the
+ *         volume has no allocation bitmap).
+ */
+int nqp_statfs(nqp_statfs_info *info);
+
+/**
+ * Get the read path's counters and call latencies, optionally resetting them.
+ *
+ * The counters are kept for the whole process, across mounts, and are
+ * updated without locks, so a snapshot taken while other threads are busy
+ * may be off by the calls in flight. Call latencies are only measured on
+ * volumes mounted with NQP_MOUNT_TIMING: reading the clock twice costs more
+ * than a cached nqp_open or a nqp_getdents. Building with -DNQP_NO_STATS
+ * leaves the counters out of the read path entirely (every count stays 0).
+ *
+ * Parameters:
+ *  * stats: Where to store the numbers. Must not be NULL.
+ *  * reset: Nonzero to zero the counters as they are read.
+ * Return: 0 on success or -1 on error.
+ */
+int nqp_stats(nqp_stats_info *stats, int reset);
+
+/**
+ * Check the mounted volume for consistency.
+ *
+ * Every cluster chain reachable from the root directory is walked once: the
+ * chains of all files and directories, the allocation bitmap and the up-case
+ * table. Chains must end with an end of chain mark without looping, every
+ * cluster in them must be allocated in the bitmap and belong to one chain
+ * only, each file's size must match its chain, and every entry set's
+ * checksum must be right. Clusters marked allocated that no chain reaches
+ * are reported too. Directories are checked on several threads at once.
+ *
+ * nqp_mount_with(..., NQP_MOUNT_FSCK) runs this when the volume is mounted.
+ *
+ * Parameters:
+ *  * report: Where to store what was found. Must not be NULL.
+ *  * threads: The number of threads to check directories with, or 0 for one
+ *             per online CPU (at most 64).
+ * Return: 0 if the volume is consistent, 1 if problems were found, or -1 on
+ *         error (e.g., no volume is mounted).
+ */
+int nqp_fsck(nqp_fsck_report *report, unsigned threads);
+
+/**
+ * Reposition the read offset of an open file, like lseek(2).
+ *
+ * Seeking forward from the current position only costs the clusters between
+ * the two positions; seeking backwards restarts the chain walk at the start
+ * of the file. Seeking past the end is allowed, reads there return 0.
+ *
+ * Parameters:
+ *  * fd: The file descriptor to reposition. Must be a nonnegative integer.
+ *  * offset: The new offset, relative to whence.
+ *  * whence: SEEK_SET, SEEK_CUR or SEEK_END.
+ * Return: The resulting offset from the start of the file, or -1 on error
+ *         (including an offset that would overflow off_t; errno is then
+ *         EOVERFLOW, as with lseek(2)).
+ */
+off_t nqp_lseek(int fd, off_t offset, int whence);
+
 /**
  * Get the directory entries for a directory. Similar to read()ing a file, you
  * may need to call this function repeatedly to get all directory entries.
@@ -125,6 +410,58 @@ ssize_t nqp_read(int fd, void *buffer, size_t count);
  */
 ssize_t nqp_getdents(int fd, void *dirp, size_t count);
 
+/**
+ * Get as many directory entries as fit in the buffer, like getdents64(2).
+ *
+ * Entries are written as variable-length nqp_dirent64 records packed one
+ * after another; step from one to the next with record_length. Names are
+ * stored inside the records, so there is nothing to free. The position in
+ * the directory is kept in the descriptor, so call this repeatedly until it
+ * returns 0.
+ *
+ * Parameters:
+ *  * fd: The file descriptor of a directory. Must be a nonnegative integer.
+ *  * dirp: The buffer into which the records will be written. Must not be
+ *          NULL.
+ *  * count: The size of the buffer in bytes.
+ * Return: The number of bytes written to the buffer, 0 at the end of the
+ *         directory, or -1 on error (including a buffer too small to hold
+ *         the next entry).
+ */
+ssize_t nqp_getdents64(int fd, void *dirp, size_t count);
+
+/**
+ * Get up to `count` directory entries, with their names stored in an arena
+ * instead of being malloc()ed one by one.
+ *
+ * The arena is reset on every call: the names returned by one call are only
+ * valid until the next call on the same arena (or descriptor). Do not free()
+ * them. Names are complete, however many FILE_NAME entries they span.
+ *
+ * Parameters:
+ *  * fd: The file descriptor of a directory. Must be a nonnegative integer.
+ *  * dirp: An array of at least `count` entries to fill in. Must not be NULL.
+ *  * count: The maximum number of entries to read. Must be greater than zero.
+ *  * arena: Where to store the names, or NULL to use a buffer owned by the
+ *           descriptor (released by nqp_close).
+ *  * arena_size: The size of arena in bytes; ignored when arena is NULL.
+ * Return: The number of entries read, which can be fewer than count when the
+ *         arena fills up, 0 at the end of the directory, or -1 on error
+ *         (including an arena too small to hold the next name).
+ */
+ssize_t nqp_getdents_arena(int fd, nqp_dirent *dirp, size_t count, char *arena, size_t arena_size);
+
+/**
+ * As nqp_getdents_arena(), also returning the metadata of every entry.
+ *
+ * Parameters:
+ *  * stats: An array of at least `count` entries; stats[i] receives the
+ *           metadata of dirp[i]. Must not be NULL.
+ *  * Others as for nqp_getdents_arena().
+ * Return: As nqp_getdents_arena().
+ */
+ssize_t nqp_getdents_stat(int fd, nqp_dirent *dirp, nqp_stat *stats, size_t count, char *arena, size_t arena_size);
+
 // Ali's own Helper Functions :::
 int nqp_size(int fd);
 
@@ -139,10 +476,15 @@ int nqp_size(int fd);
 #define nqp_read(fd, buffer, size) read(fd, buffer, size)
 #define nqp_open(name) open(name, O_RDONLY)
 #define nqp_close(fd) close(fd)
+#define nqp_lseek(fd, offset, whence) lseek(fd, offset, whence)
+#define nqp_pread(fd, buffer, size, offset) pread(fd, buffer, size, offset)
+#define nqp_preadv(fd, iov, iovcnt, offset) preadv(fd, iov, iovcnt, offset)
 
 // mount and unmount are not functions we would be able to call, so straight
 // up replace these with NQP_OK, code expecting NQP_OK will just pass through.
 #define nqp_mount(name, type) NQP_OK
+#define nqp_mount_with(name, type, flags) NQP_OK
+#define nqp_set_cache_size(clusters) ((void)(clusters))
 #define nqp_unmount() NQP_OK
 
 #endif
@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "nqp_scan.h"
+#include "thr_pool.h"
+
+// Entries read from a directory per nqp_getdents_stat call. Each batch is
+// added to the index under one lock.
+#define SCAN_BATCH 64
+#define SCAN_ARENA_SIZE (SCAN_BATCH * 256)
+
+// nqp_open takes paths shorter than this.
+#define SCAN_PATH_MAX 256
+
+typedef struct
+{
+    nqp_index *index;
+    pthread_mutex_t lock; // protects index and failed
+    size_t entries_capacity;
+    size_t names_capacity;
+    int failed; // out of memory: the index is incomplete
+    thr_pool_t *pool;
+} scan_state;
+
+// One directory to list: its position in the index and its path.
+typedef struct
+{
+    scan_state *state;
+    uint32_t dir;
+    char path[];
+} scan_job;
+
+static void *scan_directory(void *arg);
+
+/**
+ * Queue a job listing the directory at `path`, index entry `dir`.
+ * Return: 0 on success, -1 on error.
+ */
+static int queue_directory(scan_state *state, uint32_t dir, const char *path, size_t path_length)
+{
+    scan_job *job = malloc(sizeof(scan_job) + path_length + 1);
+    if (!job)
+    {
+        return -1;
+    }
+    job->state = state;
+    job->dir = dir;
+    memcpy(job->path, path, path_length + 1);
+
+    if (thr_pool_queue(state->pool, scan_directory, job) != 0)
+    {
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Make room for `entries` more entries and `names` more bytes of names.
+ * The caller holds state->lock.
+ * Return: 0 on success, -1 if out of memory.
+ */
+static int reserve(scan_state *state, size_t entries, size_t names)
+{
+    nqp_index *index = state->index;
+
+    if (index->count + entries > state->entries_capacity)
+    {
+        size_t capacity = state->entries_capacity ? state->entries_capacity * 2 : 1024;
+        while (capacity < index->count + entries)
+            capacity *= 2;
+        nqp_index_entry *grown = realloc(index->entries, capacity * sizeof(nqp_index_entry));
+        if (!grown)
+            return -1;
+        index->entries = grown;
+        state->entries_capacity = capacity;
+    }
+
+    if (index->names_size + names > state->names_capacity)
+    {
+        size_t capacity = state->names_capacity ? state->names_capacity * 2 : 16384;
+        while (capacity < index->names_size + names)
+            capacity *= 2;
+        char *grown = realloc(index->names, capacity);
+        if (!grown)
+            return -1;
+        index->names = grown;
+        state->names_capacity = capacity;
+    }
+    return 0;
+}
+
+/**
+ * Add a batch of entries from directory `dir` to the index.
+ * Return: the index of the first one, or -1 if out of memory.
+ */
+static int64_t add_entries(scan_state *state, uint32_t dir, const nqp_dirent *dirents, const nqp_stat *stats,
+                           size_t count)
+{
+    size_t names = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        names += dirents[i].name_len + 1;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    nqp_index *index = state->index;
+    if (index->count + count > UINT32_MAX || reserve(state, count, names) != 0)
+    {
+        state->failed = 1;
+        pthread_mutex_unlock(&state->lock);
+        return -1;
+    }
+
+    int64_t first = index->count;
+    for (size_t i = 0; i < count; i++)
+    {
+        nqp_index_entry *entry = &index->entries[index->count++];
+        entry->stat = stats[i];
+        entry->parent = dir;
+        entry->name = index->names_size;
+        memcpy(index->names + index->names_size, dirents[i].name, dirents[i].name_len + 1);
+        index->names_size += dirents[i].name_len + 1;
+
+        if (stats[i].attributes & NQP_ATTR_DIRECTORY)
+        {
+            index->directories++;
+        }
+        else
+        {
+            index->files++;
+            index->bytes += stats[i].size;
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return first;
+}
+
+/**
+ * Count a directory that couldn't be read (or queued).
+ */
+static void scan_error(scan_state *state)
+{
+    pthread_mutex_lock(&state->lock);
+    state->index->errors++;
+    pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Thread pool job: list one directory, add its entries to the index and
+ * queue a job for each directory in it.
+ */
+static void *scan_directory(void *arg)
+{
+    scan_job *job = arg;
+    scan_state *state = job->state;
+
+    int fd = nqp_open(job->path);
+    if (fd < 0)
+    {
+        scan_error(state);
+        free(job);
+        return NULL;
+    }
+
+    nqp_dirent dirents[SCAN_BATCH];
+    nqp_stat stats[SCAN_BATCH];
+    char arena[SCAN_ARENA_SIZE];
+    char path[SCAN_PATH_MAX];
+    size_t path_length = strlen(job->path);
+    if (path_length == 1)
+    {
+        path_length = 0; // The root: children are "/name", not "//name"
+    }
+    memcpy(path, job->path, path_length);
+
+    ssize_t read;
+    while ((read = nqp_getdents_stat(fd, dirents, stats, SCAN_BATCH, arena, sizeof(arena))) > 0)
+    {
+        int64_t first = add_entries(state, job->dir, dirents, stats, read);
+        if (first < 0)
+        {
+            break;
+        }
+
+        for (ssize_t i = 0; i < read; i++)
+        {
+            if (!(stats[i].attributes & NQP_ATTR_DIRECTORY))
+            {
+                continue;
+            }
+            size_t length = path_length + 1 + dirents[i].name_len;
+            if (length >= sizeof(path))
+            {
+                scan_error(state); // Too long for nqp_open
+                continue;
+            }
+            path[path_length] = '/';
+            memcpy(path + path_length + 1, dirents[i].name, dirents[i].name_len + 1);
+            if (queue_directory(state, first + i, path, length) != 0)
+            {
+                scan_error(state);
+            }
+        }
+    }
+    if (read < 0)
+    {
+        scan_error(state);
+    }
+
+    nqp_close(fd);
+    free(job);
+    return NULL;
+}
+
+/**
+ * Build an index of the mounted volume (see nqp_scan.h).
+ */
+int nqp_scan(nqp_index *index, unsigned threads)
+{
+    if (!index)
+    {
+        return -1;
+    }
+    memset(index, 0, sizeof(*index));
+
+    // Fail up front if there is nothing to scan (e.g., no volume mounted).
+    int root_fd = nqp_open("/");
+    if (root_fd < 0)
+    {
+        return -1;
+    }
+    nqp_close(root_fd);
+
+    if (threads == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    if (threads > UINT16_MAX)
+    {
+        threads = UINT16_MAX;
+    }
+
+    scan_state state = {.index = index};
+    pthread_mutex_init(&state.lock, NULL);
+
+    // The root directory has no entry set of its own, so only its
+    // attributes are known.
+    nqp_dirent root = {0, 0, "", DT_DIR};
+    nqp_stat root_stat = {.attributes = NQP_ATTR_DIRECTORY};
+    int result = -1;
+    if (add_entries(&state, 0, &root, &root_stat, 1) == 0)
+    {
+        state.pool = thr_pool_create(threads, threads, 1, NULL);
+        if (state.pool)
+        {
+            if (queue_directory(&state, 0, "/", 1) == 0)
+            {
+                thr_pool_wait(state.pool);
+                result = state.failed ? -1 : 0;
+            }
+            thr_pool_destroy(state.pool);
+        }
+    }
+
+    pthread_mutex_destroy(&state.lock);
+    if (result != 0)
+    {
+        nqp_index_free(index);
+    }
+    return result;
+}
+
+/**
+ * Write the path of an index entry (see nqp_scan.h).
+ */
+ssize_t nqp_index_path(const nqp_index *index, size_t entry, char *buffer, size_t size)
+{
+    if (!index || !buffer || size == 0 || entry >= index->count)
+    {
+        return -1;
+    }
+    if (entry == 0)
+    {
+        if (size < 2)
+            return -1;
+        strcpy(buffer, "/");
+        return 1;
+    }
+
+    // Work out the length first, then fill the path in from the end.
+    size_t length = 0;
+    for (size_t i = entry; i != 0; i = index->entries[i].parent)
+    {
+        length += 1 + strlen(index->names + index->entries[i].name);
+    }
+    if (length >= size)
+    {
+        return -1;
+    }
+
+    buffer[length] = '\0';
+    size_t end = length;
+    for (size_t i = entry; i != 0; i = index->entries[i].parent)
+    {
+        const char *name = index->names + index->entries[i].name;
+        size_t name_length = strlen(name);
+        end -= name_length;
+        memcpy(buffer + end, name, name_length);
+        buffer[--end] = '/';
+    }
+    return length;
+}
+
+/**
+ * Release an index (see nqp_scan.h).
+ */
+void nqp_index_free(nqp_index *index)
+{
+    if (!index)
+    {
+        return;
+    }
+    free(index->entries);
+    free(index->names);
+    memset(index, 0, sizeof(*index));
+}
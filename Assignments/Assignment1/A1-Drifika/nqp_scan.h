@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nqp_io.h"
+
+// A whole-volume index built by nqp_scan(): one entry per file and directory
+// on the mounted volume. Entries don't carry their paths; each one points at
+// the directory it is in and at its name in a shared string table, so the
+// index stays small on volumes with millions of files (see nqp_index_path).
+
+// One file or directory in an nqp_index.
+typedef struct NQP_INDEX_ENTRY
+{
+    nqp_stat stat;   // size, first cluster, attributes and timestamps
+    uint32_t parent; // index of the directory holding this entry (0 for the root)
+    uint32_t name;   // offset of the NUL-terminated name in nqp_index.names
+} nqp_index_entry;
+
+typedef struct NQP_INDEX
+{
+    nqp_index_entry *entries; // entries[0] is the root directory (only its attributes are set)
+    size_t count;             // number of entries
+    char *names;              // every entry's name, NUL-terminated
+    size_t names_size;        // bytes used in names
+
+    size_t files;       // entries that are regular files
+    size_t directories; // entries that are directories, the root included
+    uint64_t bytes;     // total size of the regular files
+    size_t errors;      // directories that couldn't be read (their contents are missing)
+} nqp_index;
+
+/**
+ * Build an index of every file and directory on the mounted volume.
+ *
+ * Directories are listed in parallel: each one is a job on a thread pool, and
+ * listing a directory queues a job for each directory it contains. The order
+ * of the entries is therefore not fixed, except that a directory always comes
+ * before its contents.
+ *
+ * Parameters:
+ *  * index: Where to store the index. Must not be NULL. Release it with
+ *           nqp_index_free().
+ *  * threads: The number of threads to list directories with, or 0 for one
+ *             per online CPU.
+ * Return: 0 on success (check index->errors for directories that couldn't be
+ *         read), or -1 on error (e.g., no volume is mounted).
+ */
+int nqp_scan(nqp_index *index, unsigned threads);
+
+/**
+ * Write the full path of an index entry to `buffer`.
+ *
+ * Parameters:
+ *  * index: An index built by nqp_scan(). Must not be NULL.
+ *  * entry: The position of the entry in index->entries.
+ *  * buffer: Where to write the NUL-terminated path. Must not be NULL.
+ *  * size: The size of buffer in bytes.
+ * Return: The length of the path, or -1 if it doesn't fit or entry is out of
+ *         range.
+ */
+ssize_t nqp_index_path(const nqp_index *index, size_t entry, char *buffer, size_t size);
+
+/**
+ * Release the memory held by an index built by nqp_scan().
+ *
+ * Parameters:
+ *  * index: The index to release. Must not be NULL.
+ */
+void nqp_index_free(nqp_index *index);
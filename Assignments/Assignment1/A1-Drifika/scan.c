@@ -0,0 +1,88 @@
+#include "nqp_io.h"
+#include "nqp_scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Print the index, one entry per line: size, first cluster, attributes,
+ * modification time (exFAT packed) and path.
+ */
+static void print_index(const nqp_index *index)
+{
+    char path[4096];
+
+    for (size_t i = 0; i < index->count; i++)
+    {
+        const nqp_stat *stat = &index->entries[i].stat;
+        if (nqp_index_path(index, i, path, sizeof(path)) < 0)
+        {
+            continue;
+        }
+        printf("%10lu %8u %04x %08x %s%s\n", (unsigned long)stat->size, stat->first_cluster, stat->attributes,
+               stat->modified_timestamp, path, (stat->attributes & NQP_ATTR_DIRECTORY) && i != 0 ? "/" : "");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned threads = 0;
+    int list = 0;
+    int option;
+
+    // Usage: scan [-l] [-j threads] image
+    while ((option = getopt(argc, argv, "lj:")) != -1)
+    {
+        switch (option)
+        {
+        case 'l':
+            list = 1;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-l] [-j threads] image\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-l] [-j threads] image\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (nqp_mount(argv[optind], NQP_FS_EXFAT) != NQP_OK)
+    {
+        fprintf(stderr, "%s: could not mount %s\n", argv[0], argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start, end;
+    nqp_index index;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = nqp_scan(&index, threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (result != 0)
+    {
+        fprintf(stderr, "%s: scan failed\n", argv[0]);
+        nqp_unmount();
+        return EXIT_FAILURE;
+    }
+
+    if (list)
+    {
+        print_index(&index);
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%zu files, %zu directories, %lu bytes, %zu unreadable directories in %.3f s\n", index.files,
+            index.directories, (unsigned long)index.bytes, index.errors, seconds);
+
+    size_t errors = index.errors;
+    nqp_index_free(&index);
+    nqp_unmount();
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,10 +1,11 @@
 #define _POSIX_C_SOURCE 200809L
 #define _GNU_SOURCE
 
-#include <fcntl.h> // For mkstemp, memfd_create
+#include <fcntl.h> // For memfd_create, F_ADD_SEALS
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -22,11 +23,50 @@
 #define MAX_ARGS 20
 #define MAX_CMDS 20 /* Maximum number of subcommands in a pipeline */
 
+/* Most bytes moved per tee/splice when copying output to the log. */
+#define RELAY_CHUNK 65536
+
+/* Number of volume files kept in the file cache. */
+#define FILE_CACHE_SIZE 32
+
 /* Globals */
 char cwd[MAX_LINE_SIZE] = "/";
 int pipeline_mode = 0;  /* set to 1 when processing a pipeline */
 static int log_fd = -1; /* -1 => no logging */
 
+/* The mounted volume, and what it looked like when it was mounted. The
+ * file cache is only valid for that exact image file. */
+static const char *volume_path = NULL;
+static struct stat volume_identity;
+
+/* One file from the volume (a program or a command's input), copied into a
+ * sealed memfd by the shell itself so that every later command can use it
+ * without copying. */
+typedef struct
+{
+    char path[MAX_LINE_SIZE]; /* path on the volume; "" if the slot is free */
+    int fd;                   /* sealed memfd (close-on-exec) */
+    int is_script;            /* starts with "#!" */
+    unsigned long last_used;  /* for LRU eviction */
+} file_cache_entry;
+
+static file_cache_entry file_cache[FILE_CACHE_SIZE];
+static unsigned long file_cache_clock = 0;
+
+/* The processes started for the last command line, one per pipeline stage,
+ * and how they ended (shown by `status`). */
+typedef struct
+{
+    pid_t pid;
+    char name[64];
+    int status;  /* from waitpid */
+    int running; /* not reaped yet */
+} stage_info;
+
+static stage_info stages[MAX_CMDS];
+static int stage_count = 0;
+static int stages_running = 0;
+
 /* We'll need this to inherit the parent's environment for execve. */
 extern char **environ;
 
@@ -34,13 +74,31 @@ extern char **environ;
 void handle_cd(char *dir);
 void handle_pwd(void);
 void handle_ls(void);
+void handle_stats(char *option);
+void handle_status(void);
+void handle_utilities(char *option);
 
-/* The main “exec in child” logic (no return). */
-void LaunchFunction(char **cmd_argv, char *input_file, int input_fd_override) __attribute__((noreturn));
+/* A command ready to start: its program and input are open in the shell,
+ * and its arguments point at them (see LaunchPrepare). */
+typedef struct
+{
+    char *argv[MAX_ARGS];
+    char fd_paths[MAX_ARGS][32]; /* /proc/self/fd/N arguments */
+    int exec_fd;                 /* the program's memfd, from the file cache */
+    int is_script;
+    int inherit_fds[MAX_ARGS]; /* memfds the program opens by path */
+    int inherit_count;
+    int stdin_fd; /* "< file", or -1 */
+} launch_plan;
+
+/* Starting a command: prepare it in the shell, then vfork and exec. */
+int LaunchPrepare(char **cmd_argv, char *input_file, launch_plan *plan);
+pid_t LaunchSpawn(launch_plan *plan, int stdin_fd, int stdout_fd);
+void LaunchRelease(launch_plan *plan);
 
 /* Helpers for input redirection & file-arg substitution. */
 int setup_input_redirection(const char *filename);
-void fix_file_args(char **cmd_argv);
+void fix_file_args(launch_plan *plan);
 
 void shell_write(const char *str)
 {
@@ -137,8 +195,10 @@ void handle_cd(char *dir)
     }
 
     /* Try opening via NQP to confirm it exists/is valid */
-    if (nqp_open(path_copy) != -1)
+    int fd = nqp_open(path_copy);
+    if (fd >= 0)
     {
+        nqp_close(fd);
         strcpy(cwd, path_copy);
     }
     else
@@ -149,25 +209,30 @@ void handle_cd(char *dir)
 
 void handle_ls(void)
 {
-    nqp_dirent entry = {0};
     int fd = nqp_open(cwd);
-    if (fd == NQP_FILE_NOT_FOUND)
+    if (fd < 0)
     {
         fprintf(stderr, "%s not found\n", cwd);
         return;
     }
 
+    /* Read the directory a buffer full of entries at a time. */
+    _Alignas(uint64_t) char dirents[4096];
     ssize_t dirents_read;
-    while ((dirents_read = nqp_getdents(fd, &entry, 1)) > 0)
+    while ((dirents_read = nqp_getdents64(fd, dirents, sizeof(dirents))) > 0)
     {
-        char buf[512];
-        snprintf(buf, sizeof(buf), "%lu %s", entry.inode_number, entry.name);
-        if (entry.type == DT_DIR)
-            strncat(buf, "/", sizeof(buf) - strlen(buf) - 1);
-        strncat(buf, "\n", sizeof(buf) - strlen(buf) - 1);
-        shell_write(buf);
-
-        free(entry.name);
+        for (ssize_t offset = 0; offset < dirents_read;)
+        {
+            nqp_dirent64 *entry = (nqp_dirent64 *)(dirents + offset);
+            char buf[512];
+            snprintf(buf, sizeof(buf), "%lu %s", (unsigned long)entry->inode_number, entry->name);
+            if (entry->type == DT_DIR)
+                strncat(buf, "/", sizeof(buf) - strlen(buf) - 1);
+            strncat(buf, "\n", sizeof(buf) - strlen(buf) - 1);
+            shell_write(buf);
+
+            offset += entry->record_length;
+        }
     }
     if (dirents_read == -1)
         fprintf(stderr, "%s is not a directory\n", cwd);
@@ -176,295 +241,1000 @@ void handle_ls(void)
 }
 
 /* ============================================================================
- * fix_file_args: For each argument that is actually an existing nqp file, we
- * copy it out to a /tmp file on the host so the child process can open it.
- * (Used by commands like: `myprogram some_nqp_file`.)
+ * File cache: files are copied out of the volume once, in the shell, into
+ * memfds sealed against writes. Children inherit the memfds across fork:
+ * programs are fexecve'd directly, and input files are passed by fd, so
+ * running `grep` again or reading `big.txt` again costs no volume reads.
  * ============================================================================
  */
-void fix_file_args(char **cmd_argv)
+
+/* Build the volume path of a name relative to the current directory. */
+static void volume_file_path(const char *name, char *abs_path, size_t size)
 {
-    for (int i = 1; cmd_argv[i] != NULL; i++)
+    if (name[0] == '/' || strcmp(cwd, "/") == 0)
+        snprintf(abs_path, size, "%s", name);
+    else
+        snprintf(abs_path, size, "%s/%s", cwd, name);
+}
+
+/* Drop every cached file. */
+static void file_cache_flush(void)
+{
+    for (int i = 0; i < FILE_CACHE_SIZE; i++)
     {
-        char abs_path[MAX_LINE_SIZE];
-        if (cmd_argv[i][0] != '/')
+        if (file_cache[i].path[0] != '\0')
         {
-            if (strcmp(cwd, "/") == 0)
-                snprintf(abs_path, sizeof(abs_path), "%s", cmd_argv[i]);
-            else
-                snprintf(abs_path, sizeof(abs_path), "%s/%s", cwd, cmd_argv[i]);
+            close(file_cache[i].fd);
+            file_cache[i].path[0] = '\0';
         }
-        else
+    }
+}
+
+/* Copy the volume file at abs_path into a new sealed memfd.
+ * Returns the memfd, -1 if there is no such file (or it is a directory), or
+ * -2 if it couldn't be copied. */
+static int file_cache_load(const char *abs_path, int *is_script)
+{
+    int nqp_fd = nqp_open(abs_path);
+    if (nqp_fd < 0)
+        return -1;
+
+    /* Directories can't be read, so they aren't files here. */
+    char probe;
+    if (nqp_read(nqp_fd, &probe, 1) < 0)
+    {
+        nqp_close(nqp_fd);
+        return -1;
+    }
+    off_t size = nqp_lseek(nqp_fd, 0, SEEK_END);
+    if (size < 0 || nqp_lseek(nqp_fd, 0, SEEK_SET) != 0)
+    {
+        nqp_close(nqp_fd);
+        return -2;
+    }
+
+    int memfd = memfd_create("nqp-file", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd == -1)
+    {
+        perror("memfd_create");
+        nqp_close(nqp_fd);
+        return -2;
+    }
+
+    /* Read straight into the memfd's pages: one copy, in large reads. */
+    off_t copied = 0;
+    *is_script = 0;
+    if (size > 0)
+    {
+        char *image = MAP_FAILED;
+        if (ftruncate(memfd, size) == 0)
+            image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (image == MAP_FAILED)
         {
-            strncpy(abs_path, cmd_argv[i], sizeof(abs_path));
-            abs_path[sizeof(abs_path) - 1] = '\0';
+            perror("mapping in-memory file");
+            close(memfd);
+            nqp_close(nqp_fd);
+            return -2;
         }
+        ssize_t got = 0;
+        while (copied < size && (got = nqp_read(nqp_fd, image + copied, size - copied)) > 0)
+            copied += got;
+        *is_script = size >= 2 && image[0] == '#' && image[1] == '!';
+        munmap(image, size);
+    }
+    nqp_close(nqp_fd);
 
-        int fd = nqp_open(abs_path);
-        if (fd != NQP_FILE_NOT_FOUND)
-        {
-            char tmp_template[] = "/tmp/volfileXXXXXX";
-            int tmp_fd = mkstemp(tmp_template);
-            if (tmp_fd == -1)
-            {
-                perror("mkstemp for file argument");
-                close(fd);
-                continue;
-            }
-            /* Copy file contents from nqp to tmp. */
-            ssize_t r, w;
-            char buf[BUFFER_SIZE];
-            while ((r = nqp_read(fd, buf, BUFFER_SIZE)) > 0)
-            {
-                w = write(tmp_fd, buf, r);
-                if (w != r)
-                {
-                    perror("write to temporary file for argument");
-                    break;
-                }
-            }
-            close(tmp_fd);
-            nqp_close(fd);
+    if (copied != size)
+    {
+        fprintf(stderr, "Error reading %s\n", abs_path);
+        close(memfd);
+        return -2;
+    }
 
-            /* Replace the argument with the new /tmp filename. */
-            cmd_argv[i] = strdup(tmp_template);
+    /* The writable mapping is gone, so the contents can be sealed. */
+    if (fchmod(memfd, 0755) == -1 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+    {
+        perror("sealing in-memory file");
+        close(memfd);
+        return -2;
+    }
+    return memfd;
+}
+
+/* Find the file at abs_path in the cache, loading it on a miss.
+ * Returns its sealed memfd (owned by the cache), -1 if there is no such
+ * file, or -2 on other errors (already reported). */
+static int file_cache_get(const char *abs_path, int *is_script)
+{
+    /* A different image file (or the same one rewritten) invalidates
+     * everything cached from it. */
+    struct stat now;
+    if (volume_path && stat(volume_path, &now) == 0 &&
+        (now.st_dev != volume_identity.st_dev || now.st_ino != volume_identity.st_ino ||
+         now.st_size != volume_identity.st_size || now.st_mtim.tv_sec != volume_identity.st_mtim.tv_sec ||
+         now.st_mtim.tv_nsec != volume_identity.st_mtim.tv_nsec))
+    {
+        file_cache_flush();
+        volume_identity = now;
+    }
+
+    int victim = 0;
+    for (int i = 0; i < FILE_CACHE_SIZE; i++)
+    {
+        if (file_cache[i].path[0] != '\0' && strcmp(file_cache[i].path, abs_path) == 0)
+        {
+            file_cache[i].last_used = ++file_cache_clock;
+            *is_script = file_cache[i].is_script;
+            return file_cache[i].fd;
         }
+        if (file_cache[i].path[0] == '\0' ||
+            (file_cache[victim].path[0] != '\0' && file_cache[i].last_used < file_cache[victim].last_used))
+            victim = i;
     }
+
+    int memfd = file_cache_load(abs_path, is_script);
+    if (memfd < 0)
+        return memfd;
+
+    file_cache_entry *entry = &file_cache[victim];
+    if (entry->path[0] != '\0')
+        close(entry->fd);
+    snprintf(entry->path, sizeof(entry->path), "%s", abs_path);
+    entry->fd = memfd;
+    entry->is_script = *is_script;
+    entry->last_used = ++file_cache_clock;
+    return memfd;
+}
+
+/* In a pipeline, head and tail get their file arguments as they are. */
+static int wants_file_args(char **cmd_argv)
+{
+    return !(pipeline_mode && (strcmp(cmd_argv[0], "head") == 0 ||
+                               strcmp(cmd_argv[0], "tail") == 0));
 }
 
 /* ============================================================================
- * setup_input_redirection: Copy an nqp file into a memfd so we can read it.
- * Then return that memfd FD. Or -1 on error.
+ * fix_file_args: For each argument that is actually an existing nqp file, we
+ * replace it with /proc/self/fd/N for the file's cached memfd, which the
+ * program inherits across exec. (Used by commands like:
+ * `myprogram some_nqp_file`.)
+ * ============================================================================
+ */
+void fix_file_args(launch_plan *plan)
+{
+    for (int i = 1; plan->argv[i] != NULL; i++)
+    {
+        char abs_path[MAX_LINE_SIZE];
+        int is_script;
+        volume_file_path(plan->argv[i], abs_path, sizeof(abs_path));
+
+        int fd = file_cache_get(abs_path, &is_script);
+        if (fd < 0)
+            continue;
+
+        /* Opening the path gives the program its own file offset. */
+        snprintf(plan->fd_paths[i], sizeof(plan->fd_paths[i]), "/proc/self/fd/%d", fd);
+        plan->argv[i] = plan->fd_paths[i];
+        plan->inherit_fds[plan->inherit_count++] = fd;
+    }
+}
+
+/* ============================================================================
+ * setup_input_redirection: Open an nqp file's cached memfd for reading.
+ * Returns a new fd at offset 0 (not shared with the cache), or -1.
  * ============================================================================
  */
 int setup_input_redirection(const char *filename)
 {
     char input_abs[MAX_LINE_SIZE];
-    if (filename[0] != '/')
+    int is_script;
+    volume_file_path(filename, input_abs, sizeof(input_abs));
+
+    int fd = file_cache_get(input_abs, &is_script);
+    if (fd == -1)
     {
-        if (strcmp(cwd, "/") == 0)
-            snprintf(input_abs, sizeof(input_abs), "%s", filename);
-        else
-            snprintf(input_abs, sizeof(input_abs), "%s/%s", cwd, filename);
+        fprintf(stderr, "Input file %s not found\n", input_abs);
+        return -1;
     }
-    else
+    if (fd < 0)
+        return -1;
+
+    char fd_path[32];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+    int input_fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+    if (input_fd == -1)
+        perror("opening input file");
+    return input_fd;
+}
+
+/* ============================================================================
+ * LaunchPrepare: everything about starting a command that can fail or needs
+ * memory happens here, in the shell: finding the program, checking that it
+ * is an ELF file or a #! script, loading it (and its file arguments) into
+ * the file cache, and opening its input file.
+ *
+ * Returns 0, or the command's exit status (127 if it doesn't exist) after
+ * reporting why it can't run.
+ * ============================================================================
+ */
+int LaunchPrepare(char **cmd_argv, char *input_file, launch_plan *plan)
+{
+    char abs_path[MAX_LINE_SIZE];
+
+    /* Build absolute path for the command from the current directory. */
+    volume_file_path(cmd_argv[0], abs_path, sizeof(abs_path));
+
+    plan->inherit_count = 0;
+    plan->stdin_fd = -1;
+    int argc = 0;
+    for (; cmd_argv[argc] != NULL && argc < MAX_ARGS - 1; argc++)
+        plan->argv[argc] = cmd_argv[argc];
+    plan->argv[argc] = NULL;
+
+    /* If the command starts with "._", skip that part. */
+    if (strncmp(plan->argv[0], "._", 2) == 0)
+        plan->argv[0] += 2;
+
+    plan->exec_fd = file_cache_get(abs_path, &plan->is_script);
+    if (plan->exec_fd == -1)
     {
-        strncpy(input_abs, filename, sizeof(input_abs));
-        input_abs[sizeof(input_abs) - 1] = '\0';
+        fprintf(stderr, "Command %s not found\n", abs_path);
+        return 127;
     }
+    if (plan->exec_fd < 0)
+        return 1;
 
-    int fd = nqp_open(input_abs);
-    if (fd == NQP_FILE_NOT_FOUND)
+    char header[4];
+    if (!plan->is_script &&
+        (pread(plan->exec_fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, "\177ELF", 4) != 0))
     {
-        fprintf(stderr, "Input file %s not found\n", input_abs);
-        return -1;
+        fprintf(stderr, "%s: not an ELF executable or #! script\n", abs_path);
+        return 126;
     }
-    int memfd_in = memfd_create("In-Memory-Input", MFD_CLOEXEC);
-    if (memfd_in == -1)
+
+    /* If not in pipeline for head/tail, fix file args. */
+    if (wants_file_args(plan->argv))
     {
-        perror("memfd_create for input");
-        nqp_close(fd);
-        return -1;
+        fix_file_args(plan);
     }
-    ssize_t r, w;
-    char buf[BUFFER_SIZE];
-    while ((r = nqp_read(fd, buf, BUFFER_SIZE)) > 0)
+
+    /* Input redirection if needed. */
+    if (input_file != NULL)
     {
-        w = write(memfd_in, buf, r);
-        if (w != r)
-        {
-            fprintf(stderr, "Error writing input file to memory file\n");
-            close(memfd_in);
-            nqp_close(fd);
-            return -1;
-        }
+        plan->stdin_fd = setup_input_redirection(input_file);
+        if (plan->stdin_fd == -1)
+            return 1;
     }
-    if (r < 0)
+    return 0;
+}
+
+/* Release what LaunchPrepare opened once the command is running. */
+void LaunchRelease(launch_plan *plan)
+{
+    if (plan->stdin_fd != -1)
     {
-        fprintf(stderr, "Error reading input file %s\n", input_abs);
-        close(memfd_in);
-        nqp_close(fd);
-        return -1;
+        close(plan->stdin_fd);
+        plan->stdin_fd = -1;
     }
-    nqp_close(fd);
+}
 
-    if (lseek(memfd_in, 0, SEEK_SET) == -1)
+/* ============================================================================
+ * LaunchSpawn: start a prepared command with vfork, reading stdin_fd and
+ * writing stdout_fd (-1 keeps the shell's own). The child borrows the
+ * shell's memory until it execs, so nothing is copied however large the
+ * shell's heap (and file cache) is; it may only make system calls: dup2,
+ * clearing close-on-exec on the fds the program needs, and fexecve.
+ *
+ * Returns the child's pid, or -1.
+ * ============================================================================
+ */
+pid_t LaunchSpawn(launch_plan *plan, int stdin_fd, int stdout_fd)
+{
+    if (plan->stdin_fd != -1)
+        stdin_fd = plan->stdin_fd; /* "< file" wins over a pipe */
+
+    pid_t pid = vfork();
+    if (pid == 0)
     {
-        perror("lseek on input memfd");
-        close(memfd_in);
-        return -1;
+        if ((stdin_fd != -1 && dup2(stdin_fd, STDIN_FILENO) == -1) ||
+            (stdout_fd != -1 && dup2(stdout_fd, STDOUT_FILENO) == -1))
+            _exit(126);
+        for (int i = 0; i < plan->inherit_count; i++)
+            fcntl(plan->inherit_fds[i], F_SETFD, 0);
+
+        /* A #! script is run by its interpreter from /dev/fd/N, so the
+         * memfd has to stay open across the exec. */
+        if (plan->is_script)
+            fcntl(plan->exec_fd, F_SETFD, 0);
+        fexecve(plan->exec_fd, plan->argv, environ);
+
+        static const char message[] = "fexecve failed\n";
+        if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0)
+        {
+            /* Nothing more to do: the child exits either way */
+        }
+        _exit(126);
     }
-    return memfd_in;
+    if (pid < 0)
+        perror("vfork");
+    return pid;
 }
 
 /* ============================================================================
- * LaunchFunction: In this child process, sets up input redirection (if any),
- * fixes file args (if not in pipeline for head/tail), then does an exec
- * by copying the NQP file into a memfd, checking if it's #! or ELF, etc.
- *
- * This function never returns (calls _exit on error or after exec).
+ * Pipeline stages: children are reaped in whatever order they exit, and the
+ * last stage's output is copied to stdout and the log file inside the kernel.
  * ============================================================================
  */
-void LaunchFunction(char **cmd_argv, char *input_file, int input_fd_override)
+
+/* Start recording a new command line's stages. */
+static void stages_reset(void)
 {
-    int exec_fd;
-    char abs_path[MAX_LINE_SIZE];
+    stage_count = 0;
+    stages_running = 0;
+}
 
-    /* Build absolute path for the command from the current directory. */
-    if (strcmp(cwd, "/") == 0)
-        snprintf(abs_path, sizeof(abs_path), "%s", cmd_argv[0]);
-    else
-        snprintf(abs_path, sizeof(abs_path), "%s/%s", cwd, cmd_argv[0]);
+/* Record a stage's child process. */
+static void stage_started(const char *name, pid_t pid)
+{
+    stage_info *stage = &stages[stage_count++];
+    stage->pid = pid;
+    snprintf(stage->name, sizeof(stage->name), "%s", name);
+    stage->status = 0;
+    stage->running = 1;
+    stages_running++;
+}
 
-    /* If the command starts with "._", skip that part. */
-    if (strncmp(cmd_argv[0], "._", 2) == 0)
-        cmd_argv[0] += 2;
+/* Record a stage that ran inside the shell and has already finished. */
+static void stage_finished(const char *name, int exit_status)
+{
+    stage_info *stage = &stages[stage_count++];
+    stage->pid = 0;
+    snprintf(stage->name, sizeof(stage->name), "%s", name);
+    stage->status = W_EXITCODE(exit_status, 0);
+    stage->running = 0;
+}
 
-    exec_fd = nqp_open(abs_path);
-    if (exec_fd == NQP_FILE_NOT_FOUND)
+/* Reap stages as they exit: with WNOHANG only those that already have,
+ * otherwise until one does. A stage killed by a signal is reported, except
+ * SIGPIPE, which is how `... | head` normally ends. */
+static void reap_stages(int options)
+{
+    while (stages_running > 0)
     {
-        fprintf(stderr, "Command %s not found\n", abs_path);
-        _exit(127);
+        int status;
+        pid_t pid = waitpid(-1, &status, options);
+        if (pid == -1 && errno == EINTR)
+            continue;
+        if (pid <= 0)
+        {
+            if (pid == -1) /* ECHILD: nothing left to wait for */
+                stages_running = 0;
+            return;
+        }
+
+        for (int i = 0; i < stage_count; i++)
+        {
+            if (stages[i].running && stages[i].pid == pid)
+            {
+                stages[i].status = status;
+                stages[i].running = 0;
+                stages_running--;
+                if (WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE)
+                    fprintf(stderr, "%s: %s\n", stages[i].name, strsignal(WTERMSIG(status)));
+                break;
+            }
+        }
+        if (!(options & WNOHANG))
+            return;
     }
+}
 
-    /* Copy the command into a memfd so we can fexecve or handle #!. */
-    int InMemoryFile = memfd_create("In-Memory-File", MFD_CLOEXEC);
-    if (InMemoryFile == -1)
+/* Wait for every stage of the command line to exit. */
+static void wait_stages(void)
+{
+    while (stages_running > 0)
+        reap_stages(0);
+}
+
+/* Built-in: print how each stage of the last command line ended. */
+void handle_status(void)
+{
+    char buf[128];
+    for (int i = 0; i < stage_count; i++)
     {
-        perror("memfd_create");
-        _exit(1);
+        int status = stages[i].status;
+        if (stages[i].running)
+            snprintf(buf, sizeof(buf), "%d %s: running\n", i + 1, stages[i].name);
+        else if (WIFSIGNALED(status))
+            snprintf(buf, sizeof(buf), "%d %s: %s\n", i + 1, stages[i].name, strsignal(WTERMSIG(status)));
+        else
+            snprintf(buf, sizeof(buf), "%d %s: exit %d\n", i + 1, stages[i].name, WEXITSTATUS(status));
+        shell_write(buf);
     }
+}
 
-    /* Copy the file contents from nqp into the memfd. */
-    ssize_t bytes_read, bytes_written;
-    char buffer[BUFFER_SIZE];
-    while ((bytes_read = nqp_read(exec_fd, buffer, BUFFER_SIZE)) > 0)
+/* Move exactly n bytes from the pipe `from` to `to` with splice(2).
+ * Returns 0, or -1 if `to` doesn't support splice (e.g. a terminal) before
+ * anything was moved. */
+static int splice_all(int from, int to, size_t n)
+{
+    size_t moved = 0;
+    while (moved < n)
     {
-        bytes_written = write(InMemoryFile, buffer, bytes_read);
-        if (bytes_written != bytes_read)
+        ssize_t r = splice(from, NULL, to, NULL, n - moved, SPLICE_F_MOVE);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
         {
-            fprintf(stderr, "Error writing to in-memory file\n");
-            _exit(1);
+            if (moved == 0 && r == -1 && errno == EINVAL)
+                return -1;
+            /* The reader went away: drop the rest. */
+            char buf[BUFFER_SIZE];
+            while (moved < n && (r = read(from, buf, n - moved < sizeof(buf) ? n - moved : sizeof(buf))) > 0)
+                moved += r;
+            return 0;
         }
+        moved += r;
     }
-    nqp_close(exec_fd);
+    return 0;
+}
 
-    if (bytes_read < 0)
+/* Copy n bytes from the pipe `from` to `to` through a buffer. */
+static void copy_all(int from, int to, size_t n)
+{
+    char buf[RELAY_CHUNK];
+    while (n > 0)
     {
-        fprintf(stderr, "Error reading the source file\n");
-        _exit(1);
+        ssize_t r = read(from, buf, n < sizeof(buf) ? n : sizeof(buf));
+        if (r <= 0)
+            return;
+        if (write(to, buf, r) != r)
+        {
+            /* Keep draining so the sender isn't blocked. */
+        }
+        n -= r;
+    }
+}
+
+/* Copy everything written to the pipe `from` to stdout and the log file.
+ * tee(2) duplicates what is waiting in `from` into a second pipe; splice(2)
+ * then moves one copy to the log and the other to stdout, so the data never
+ * passes through the shell's memory (except to a terminal, which can't be
+ * spliced to). Stages that exit meanwhile are reaped. */
+static void relay_output(int from)
+{
+    int copy[2];
+    if (pipe2(copy, O_CLOEXEC) == -1)
+    {
+        char buf[RELAY_CHUNK];
+        ssize_t n;
+        while ((n = read(from, buf, sizeof(buf))) > 0)
+            shell_write_buf(buf, n);
+        return;
     }
-    if (fchmod(InMemoryFile, 0755) == -1)
+
+    int stdout_splices = 1;
+    for (;;)
     {
-        perror("fchmod");
-        _exit(1);
+        ssize_t n = tee(from, copy[1], RELAY_CHUNK, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        if (splice_all(from, log_fd, n) == -1)
+            copy_all(from, log_fd, n);
+        if (!stdout_splices || splice_all(copy[0], STDOUT_FILENO, n) == -1)
+        {
+            stdout_splices = 0;
+            copy_all(copy[0], STDOUT_FILENO, n);
+        }
+        reap_stages(WNOHANG);
     }
-    if (lseek(InMemoryFile, 0, SEEK_SET) == -1)
+    close(copy[0]);
+    close(copy[1]);
+}
+
+/* ============================================================================
+ * Fast utilities: cat, head, tail, wc and echo run inside the shell instead
+ * of being launched from the volume. Alone on a line they run in-process and
+ * read volume files directly with large nqp_read calls; in a pipeline they
+ * run in the stage's forked child without an exec. Anything they don't
+ * support (e.g. `head -c`) falls back to the program on the volume, as does
+ * everything after `utilities off`.
+ * ============================================================================
+ */
+
+/* Options understood by the fast utilities. */
+typedef struct
+{
+    long lines;      /* head/tail: -n N */
+    int count_lines; /* wc -l */
+    int count_words; /* wc -w */
+    int count_bytes; /* wc -c */
+    int no_newline;  /* echo -n */
+    int operands;    /* index in argv of the first file (or word, for echo) */
+} utility_options;
+
+/* Where a utility reads from: a volume file or a host fd (stdin). */
+typedef struct
+{
+    int fd;
+    int is_nqp;
+    int opened; /* by utility_open, so it's closed after use */
+} utility_input;
+
+typedef struct
+{
+    const char *name;
+    int (*run)(char **argv, const utility_options *options, utility_input *stdin_input);
+} utility_command;
+
+static int utilities_enabled = 1;
+
+static ssize_t utility_read(utility_input *input, void *buf, size_t count)
+{
+    if (input->is_nqp)
+        return nqp_read(input->fd, buf, count);
+    ssize_t n;
+    do
+        n = read(input->fd, buf, count);
+    while (n == -1 && errno == EINTR);
+    return n;
+}
+
+/* Open a file operand: "-" is stdin, anything else is a volume file.
+ * Returns 0, or -1 after reporting the error. */
+static int utility_open(const char *utility, const char *name, utility_input *stdin_input, utility_input *input)
+{
+    if (strcmp(name, "-") == 0)
     {
-        perror("lseek before header debug");
-        _exit(1);
+        *input = *stdin_input;
+        input->opened = 0;
+        return 0;
     }
 
-    unsigned char debug_header[16];
-    bytes_read = read(InMemoryFile, debug_header, sizeof(debug_header));
-    if (bytes_read != (ssize_t)sizeof(debug_header))
+    char abs_path[MAX_LINE_SIZE];
+    volume_file_path(name, abs_path, sizeof(abs_path));
+    input->fd = nqp_open(abs_path);
+    input->is_nqp = 1;
+    input->opened = 1;
+    if (input->fd < 0)
     {
-        perror("read header");
-        _exit(1);
+        fprintf(stderr, "%s: %s: No such file or directory\n", utility, name);
+        return -1;
     }
-    if (lseek(InMemoryFile, 0, SEEK_SET) == -1)
+    char probe;
+    if (nqp_read(input->fd, &probe, 1) < 0 || nqp_lseek(input->fd, 0, SEEK_SET) != 0)
     {
-        perror("lseek after header debug");
-        _exit(1);
+        fprintf(stderr, "%s: %s: Is a directory\n", utility, name);
+        nqp_close(input->fd);
+        return -1;
     }
+    return 0;
+}
 
-    /* If not in pipeline for head/tail, fix file args. */
-    if (!(pipeline_mode && (strcmp(cmd_argv[0], "head") == 0 ||
-                            strcmp(cmd_argv[0], "tail") == 0)))
+static void utility_close(utility_input *input)
+{
+    if (input->opened)
+        nqp_close(input->fd);
+}
+
+/* Parse the options of utility argv[0]. Returns 0, or -1 if they include
+ * something only the real program handles. */
+static int utility_parse(char **argv, utility_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->lines = 10;
+
+    const char *name = argv[0];
+    int i = 1;
+    if (strcmp(name, "echo") == 0)
     {
-        fix_file_args(cmd_argv);
+        for (; argv[i] && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+        {
+            if (strcmp(argv[i], "-n") != 0)
+                break; /* GNU echo prints unknown options as words, but -e/-E change escapes */
+            options->no_newline = 1;
+        }
+        if (argv[i] && (strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "-E") == 0))
+            return -1;
+        options->operands = i;
+        return 0;
     }
 
-    /* Input redirection if needed. */
-    if (input_file != NULL || input_fd_override != -1)
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
     {
-        int new_stdin_fd;
-        if (input_file != NULL)
+        const char *option = argv[i];
+        if (strcmp(option, "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(name, "head") == 0 || strcmp(name, "tail") == 0)
+        {
+            const char *count;
+            if (strcmp(option, "-n") == 0)
+                count = argv[++i];
+            else if (option[1] == 'n')
+                count = option + 2;
+            else
+                count = option + 1; /* the old "-5" form */
+            char *end;
+            if (!count || *count < '0' || *count > '9')
+                return -1;
+            options->lines = strtol(count, &end, 10);
+            if (*end != '\0')
+                return -1;
+        }
+        else if (strcmp(name, "wc") == 0)
         {
-            new_stdin_fd = setup_input_redirection(input_file);
-            if (new_stdin_fd == -1)
-                _exit(1);
+            for (const char *flag = option + 1; *flag; flag++)
+            {
+                if (*flag == 'l')
+                    options->count_lines = 1;
+                else if (*flag == 'w')
+                    options->count_words = 1;
+                else if (*flag == 'c')
+                    options->count_bytes = 1;
+                else
+                    return -1;
+            }
         }
         else
         {
-            new_stdin_fd = input_fd_override;
+            return -1; /* cat: no options */
         }
-        if (dup2(new_stdin_fd, STDIN_FILENO) == -1)
+    }
+    if (strcmp(name, "wc") == 0 && !options->count_lines && !options->count_words && !options->count_bytes)
+        options->count_lines = options->count_words = options->count_bytes = 1;
+    options->operands = i;
+    return 0;
+}
+
+static int utility_echo(char **argv, const utility_options *options, utility_input *stdin_input)
+{
+    (void)stdin_input;
+    char buf[MAX_LINE_SIZE + 2];
+    size_t used = 0;
+    for (int i = options->operands; argv[i]; i++)
+    {
+        size_t length = strlen(argv[i]);
+        if (used + length + 2 > sizeof(buf))
+        {
+            shell_write_buf(buf, used);
+            used = 0;
+        }
+        if (i > options->operands)
+            buf[used++] = ' ';
+        if (length + 2 > sizeof(buf))
         {
-            perror("dup2 for input");
-            _exit(1);
+            /* Too long to buffer: flush what precedes it first. */
+            shell_write_buf(buf, used);
+            used = 0;
+            shell_write_buf(argv[i], length);
         }
-        close(new_stdin_fd);
+        else
+        {
+            memcpy(buf + used, argv[i], length);
+            used += length;
+        }
+    }
+    if (!options->no_newline)
+        buf[used++] = '\n';
+    shell_write_buf(buf, used);
+    return 0;
+}
+
+/* Run `copy` on each file operand (or stdin), as cat, head and tail do. */
+static int utility_each(char **argv, const utility_options *options, utility_input *stdin_input,
+                        int (*copy)(utility_input *input, const utility_options *options))
+{
+    char *stdin_operand[] = {"-", NULL};
+    char **operands = argv[options->operands] ? argv + options->operands : stdin_operand;
+    int multiple = operands[0] && operands[1];
+    int status = 0;
+
+    for (int i = 0; operands[i]; i++)
+    {
+        utility_input input;
+        if (utility_open(argv[0], operands[i], stdin_input, &input) == -1)
+        {
+            status = 1;
+            continue;
+        }
+        if (multiple && strcmp(argv[0], "cat") != 0)
+        {
+            char header[MAX_LINE_SIZE + 16];
+            int length = snprintf(header, sizeof(header), "%s==> %s <==\n", i > 0 ? "\n" : "",
+                                  strcmp(operands[i], "-") == 0 ? "standard input" : operands[i]);
+            shell_write_buf(header, length);
+        }
+        if (copy(&input, options) == -1)
+        {
+            fprintf(stderr, "%s: error reading %s\n", argv[0], operands[i]);
+            status = 1;
+        }
+        utility_close(&input);
+    }
+    return status;
+}
+
+static int copy_all_input(utility_input *input, const utility_options *options)
+{
+    (void)options;
+    char buf[RELAY_CHUNK];
+    ssize_t n;
+    while ((n = utility_read(input, buf, sizeof(buf))) > 0)
+        shell_write_buf(buf, n);
+    return n < 0 ? -1 : 0;
+}
+
+static int copy_head(utility_input *input, const utility_options *options)
+{
+    char buf[RELAY_CHUNK];
+    long remaining = options->lines;
+    ssize_t n = 0;
+    while (remaining > 0 && (n = utility_read(input, buf, sizeof(buf))) > 0)
+    {
+        char *end = buf;
+        while (remaining > 0 && (end = memchr(end, '\n', buf + n - end)) != NULL)
+        {
+            end++;
+            remaining--;
+        }
+        shell_write_buf(buf, remaining == 0 ? end - buf : n);
+    }
+    return n < 0 ? -1 : 0;
+}
+
+/* Scan buf backwards for newlines; returns the offset just past the one that
+ * completes `*remaining`, or -1 (with *remaining reduced) if there isn't one. */
+static ssize_t tail_scan(const char *buf, size_t length, long *remaining)
+{
+    for (size_t i = length; i-- > 0;)
+    {
+        if (buf[i] == '\n' && --*remaining == 0)
+            return i + 1;
     }
+    return -1;
+}
 
-    /*
-     * IMPORTANT: Remove the real chdir(cwd).
-     *
-     * // if (chdir(cwd) == -1)
-     * // {
-     * //     perror("chdir");
-     * //     _exit(1);
-     * // }
-     */
+static int copy_tail(utility_input *input, const utility_options *options)
+{
+    char buf[RELAY_CHUNK];
+    if (options->lines == 0)
+        return 0;
 
-    /* If #! script => copy to temp file and execve. Otherwise fexecve. */
-    if (debug_header[0] == '#' && debug_header[1] == '!')
+    if (input->is_nqp)
     {
-        /* Shell script. Copy in-memory file to a /tmp script, then execve. */
-        char tmp_template[] = "/tmp/scriptXXXXXX";
-        int tmp_fd = mkstemp(tmp_template);
-        if (tmp_fd == -1)
+        /* A volume file: read backwards from the end in large chunks until
+         * enough lines are found, then copy from there. */
+        off_t size = nqp_lseek(input->fd, 0, SEEK_END);
+        if (size < 0)
+            return -1;
+        off_t end = size, start = 0;
+        long remaining = options->lines;
+        int skip_last = 1; /* a final newline ends the last line */
+        while (end > 0)
         {
-            perror("mkstemp");
-            _exit(1);
+            off_t chunk = end > (off_t)sizeof(buf) ? (off_t)sizeof(buf) : end;
+            off_t offset = end - chunk;
+            if (nqp_lseek(input->fd, offset, SEEK_SET) != offset || utility_read(input, buf, chunk) != chunk)
+                return -1;
+            if (skip_last && buf[chunk - 1] == '\n')
+                chunk--;
+            skip_last = 0;
+            ssize_t found = tail_scan(buf, chunk, &remaining);
+            if (found >= 0)
+            {
+                start = offset + found;
+                break;
+            }
+            end = offset;
         }
-        while ((bytes_read = read(InMemoryFile, buffer, BUFFER_SIZE)) > 0)
+        if (nqp_lseek(input->fd, start, SEEK_SET) != start)
+            return -1;
+        return copy_all_input(input, options);
+    }
+
+    /* stdin: keep everything, then print the last lines. */
+    size_t used = 0, capacity = 0;
+    char *data = NULL;
+    ssize_t n;
+    do
+    {
+        if (used == capacity)
         {
-            if (write(tmp_fd, buffer, bytes_read) != bytes_read)
+            capacity = capacity ? capacity * 2 : sizeof(buf);
+            char *grown = realloc(data, capacity);
+            if (!grown)
             {
-                perror("write to tmp file");
-                close(tmp_fd);
-                _exit(1);
+                free(data);
+                return -1;
             }
+            data = grown;
         }
-        if (bytes_read < 0)
+        n = utility_read(input, data + used, capacity - used);
+        if (n > 0)
+            used += n;
+    } while (n > 0);
+
+    long remaining = options->lines;
+    ssize_t found = used > 0 ? tail_scan(data, used - (data[used - 1] == '\n'), &remaining) : -1;
+    size_t start = found >= 0 ? (size_t)found : 0;
+    shell_write_buf(data + start, used - start);
+    free(data);
+    return n < 0 ? -1 : 0;
+}
+
+static int utility_cat(char **argv, const utility_options *options, utility_input *stdin_input)
+{
+    return utility_each(argv, options, stdin_input, copy_all_input);
+}
+
+static int utility_head(char **argv, const utility_options *options, utility_input *stdin_input)
+{
+    return utility_each(argv, options, stdin_input, copy_head);
+}
+
+static int utility_tail(char **argv, const utility_options *options, utility_input *stdin_input)
+{
+    return utility_each(argv, options, stdin_input, copy_tail);
+}
+
+static void wc_print(const utility_options *options, const unsigned long counts[3], int width, const char *name)
+{
+    char line[MAX_LINE_SIZE + 80];
+    int length = 0;
+    const int selected[3] = {options->count_lines, options->count_words, options->count_bytes};
+    for (int i = 0; i < 3; i++)
+    {
+        if (selected[i])
+            length += snprintf(line + length, sizeof(line) - length, "%s%*lu", length ? " " : "", width, counts[i]);
+    }
+    length += snprintf(line + length, sizeof(line) - length, "%s%s\n", name ? " " : "", name ? name : "");
+    shell_write_buf(line, length < (int)sizeof(line) ? length : (int)sizeof(line) - 1);
+}
+
+static int utility_wc(char **argv, const utility_options *options, utility_input *stdin_input)
+{
+    char *stdin_operand[] = {"-", NULL};
+    char **operands = argv[options->operands] ? argv + options->operands : stdin_operand;
+    int files = 0, from_pipe = 0, fields = options->count_lines + options->count_words + options->count_bytes;
+    unsigned long sizes = 0;
+
+    /* Pick the column width the way GNU wc does: wide enough for the total
+     * size of the files, at least 7 if one is a pipe, and no padding at all
+     * for a single number. */
+    for (int i = 0; operands[i]; i++, files++)
+    {
+        int fd = -1;
+        if (strcmp(operands[i], "-") != 0)
         {
-            perror("read from in-memory file");
-            close(tmp_fd);
-            _exit(1);
+            char abs_path[MAX_LINE_SIZE];
+            volume_file_path(operands[i], abs_path, sizeof(abs_path));
+            fd = nqp_open(abs_path);
         }
-        if (fchmod(tmp_fd, 0755) == -1)
+        else if (stdin_input->is_nqp)
+            fd = stdin_input->fd;
+        else
+            from_pipe = 1;
+        if (fd >= 0)
         {
-            perror("fchmod tmp file");
-            close(tmp_fd);
-            _exit(1);
+            off_t size = nqp_lseek(fd, 0, SEEK_END);
+            sizes += size > 0 ? size : 0;
+            if (fd == stdin_input->fd)
+                nqp_lseek(fd, 0, SEEK_SET);
+            else
+                nqp_close(fd);
         }
-        close(tmp_fd);
+    }
+    int width = 1;
+    if (fields > 1 || files > 1)
+    {
+        for (; sizes >= 10; sizes /= 10)
+            width++;
+        if (from_pipe && width < 7)
+            width = 7;
+    }
 
-        execve(tmp_template, cmd_argv, environ);
-        perror("execve (script)");
-        _exit(1);
+    unsigned long totals[3] = {0, 0, 0};
+    int status = 0;
+    char buf[RELAY_CHUNK];
+    for (int i = 0; operands[i]; i++)
+    {
+        utility_input input;
+        if (utility_open(argv[0], operands[i], stdin_input, &input) == -1)
+        {
+            status = 1;
+            continue;
+        }
+        unsigned long counts[3] = {0, 0, 0};
+        int in_word = 0;
+        ssize_t n;
+        while ((n = utility_read(&input, buf, sizeof(buf))) > 0)
+        {
+            counts[2] += n;
+            for (ssize_t j = 0; j < n; j++)
+            {
+                unsigned char c = buf[j];
+                int space = c == ' ' || (c >= '\t' && c <= '\r');
+                counts[0] += c == '\n';
+                counts[1] += !space && !in_word;
+                in_word = !space;
+            }
+        }
+        if (n < 0)
+        {
+            fprintf(stderr, "%s: error reading %s\n", argv[0], operands[i]);
+            status = 1;
+        }
+        utility_close(&input);
+        wc_print(options, counts, width, argv[options->operands] ? operands[i] : NULL);
+        for (int k = 0; k < 3; k++)
+            totals[k] += counts[k];
     }
-    else
+    if (files > 1)
+        wc_print(options, totals, width, "total");
+    return status;
+}
+
+static const utility_command utility_commands[] = {
+    {"cat", utility_cat}, {"head", utility_head}, {"tail", utility_tail}, {"wc", utility_wc}, {"echo", utility_echo},
+};
+
+/* Find the fast version of a command, if there is one for these options. */
+static const utility_command *utility_lookup(char **argv, utility_options *options)
+{
+    if (!utilities_enabled)
+        return NULL;
+    for (size_t i = 0; i < sizeof(utility_commands) / sizeof(utility_commands[0]); i++)
     {
-        /* ELF or other binary => fexecve directly. */
-        if (fexecve(InMemoryFile, cmd_argv, environ) == -1)
+        if (strcmp(argv[0], utility_commands[i].name) == 0)
+            return utility_parse(argv, options) == 0 ? &utility_commands[i] : NULL;
+    }
+    return NULL;
+}
+
+/* Run a fast utility with stdin, or the volume file input_file, as its
+ * standard input. Returns its exit status. */
+static int utility_run(const utility_command *utility, char **argv, const utility_options *options,
+                       const char *input_file)
+{
+    utility_input stdin_input = {STDIN_FILENO, 0, 0};
+    if (input_file != NULL)
+    {
+        char abs_path[MAX_LINE_SIZE];
+        volume_file_path(input_file, abs_path, sizeof(abs_path));
+        stdin_input.fd = nqp_open(abs_path);
+        stdin_input.is_nqp = 1;
+        if (stdin_input.fd < 0)
         {
-            perror("fexecve");
-            _exit(1);
+            fprintf(stderr, "Input file %s not found\n", abs_path);
+            return 1;
         }
     }
-    /* not reached */
-    _exit(1);
+    int status = utility->run(argv, options, &stdin_input);
+    if (stdin_input.is_nqp)
+        nqp_close(stdin_input.fd);
+    return status;
+}
+
+/* Built-in: turn the fast utilities on or off, or show whether they're on. */
+void handle_utilities(char *option)
+{
+    if (option && strcmp(option, "on") == 0)
+        utilities_enabled = 1;
+    else if (option && strcmp(option, "off") == 0)
+        utilities_enabled = 0;
+    else if (option)
+    {
+        fprintf(stderr, "usage: utilities [on|off]\n");
+        return;
+    }
+    shell_write(utilities_enabled ? "utilities on: cat head tail wc echo\n" : "utilities off\n");
 }
 
 /* ============================================================================
@@ -541,7 +1311,7 @@ void LaunchPipeline(char *line)
     int pipes[MAX_CMDS - 1][2];
     for (int i = 0; i < num_cmds - 1; i++)
     {
-        if (pipe(pipes[i]) == -1)
+        if (pipe2(pipes[i], O_CLOEXEC) == -1)
         {
             perror("pipe");
             pipeline_mode = 0;
@@ -554,7 +1324,7 @@ void LaunchPipeline(char *line)
     int using_log_pipe = 0;
     if (log_fd >= 0)
     {
-        if (pipe(final_pipe) == -1)
+        if (pipe2(final_pipe, O_CLOEXEC) == -1)
         {
             perror("pipe (final logging)");
             pipeline_mode = 0;
@@ -563,9 +1333,38 @@ void LaunchPipeline(char *line)
         using_log_pipe = 1;
     }
 
-    pid_t pids[MAX_CMDS];
+    /* The fast utilities read the volume themselves. */
+    utility_options options[MAX_CMDS];
+    const utility_command *utilities[MAX_CMDS];
+    for (int i = 0; i < num_cmds; i++)
+    {
+        utilities[i] = cmd_argvs[i][0] ? utility_lookup(cmd_argvs[i], &options[i]) : NULL;
+    }
+
+    stages_reset();
     for (int i = 0; i < num_cmds; i++)
     {
+        const char *name = cmd_argvs[i][0] ? cmd_argvs[i][0] : "";
+        if (cmd_argvs[i][0] && !utilities[i])
+        {
+            /* Prepare and start each stage before preparing the next: a plan
+             * holds file cache fds, and a later stage's cache misses could
+             * evict (close) them. One stage uses at most MAX_ARGS + 1 cache
+             * entries, fewer than FILE_CACHE_SIZE, so it can't evict its own. */
+            launch_plan plan;
+            int stdin_fd = i > 0 ? pipes[i - 1][0] : -1;
+            int stdout_fd = i < num_cmds - 1 ? pipes[i][1] : (using_log_pipe ? final_pipe[1] : -1);
+            int failed = LaunchPrepare(cmd_argvs[i], input_files[i], &plan);
+            pid_t pid = failed ? -1 : LaunchSpawn(&plan, stdin_fd, stdout_fd);
+            LaunchRelease(&plan);
+            if (pid < 0)
+                stage_finished(name, failed ? failed : 1);
+            else
+                stage_started(name, pid);
+            continue;
+        }
+
+        /* A fast utility (or an empty stage) runs in a forked child. */
         pid_t pid = fork();
         if (pid < 0)
         {
@@ -607,12 +1406,15 @@ void LaunchPipeline(char *line)
                 close(final_pipe[1]);
             }
 
-            LaunchFunction(cmd_argvs[i], input_files[i], -1);
+            if (!utilities[i])
+                _exit(0);
+            log_fd = -1; /* The shell copies the last stage's output to the log */
+            _exit(utility_run(utilities[i], cmd_argvs[i], &options[i], input_files[i]));
         }
         else
         {
             /* parent */
-            pids[i] = pid;
+            stage_started(name, pid);
         }
     }
 
@@ -627,29 +1429,103 @@ void LaunchPipeline(char *line)
         close(final_pipe[1]); /* we read from final_pipe[0] */
     }
 
-    /* Wait for all but last child, or do concurrency.
-       We'll just wait in order here. */
-    for (int i = 0; i < num_cmds - 1; i++)
+    /* If logging, copy final_pipe[0] to stdout and the log while the
+     * stages run, reaping them as they exit. */
+    if (using_log_pipe)
     {
-        waitpid(pids[i], NULL, 0);
+        relay_output(final_pipe[0]);
+        close(final_pipe[0]);
     }
+    wait_stages();
 
-    /* If logging, read from final_pipe[0] => shell_write_buf => logs+stdout. */
-    if (using_log_pipe)
+    pipeline_mode = 0;
+}
+
+/* Write a duration in ns as "750ns", "12us" or "3ms". */
+static void format_ns(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 1000)
+        snprintf(buf, size, "%luns", (unsigned long)ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%luus", (unsigned long)(ns / 1000));
+    else
+        snprintf(buf, size, "%lums", (unsigned long)(ns / 1000000));
+}
+
+/* Print one call latency histogram, skipping empty buckets. */
+static void print_latency(const char *name, const nqp_latency *latency)
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf), "%-9s %lu calls", name, (unsigned long)latency->calls);
+    if (latency->timed_calls > 0)
     {
-        char buf[BUFFER_SIZE];
-        ssize_t rcount;
-        while ((rcount = read(final_pipe[0], buf, sizeof(buf))) > 0)
-        {
-            shell_write_buf(buf, rcount);
-        }
-        close(final_pipe[0]);
+        char mean[32];
+        format_ns(mean, sizeof(mean), latency->total_ns / latency->timed_calls);
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), ", mean %s", mean);
     }
+    strncat(buf, "\n", sizeof(buf) - strlen(buf) - 1);
+    shell_write(buf);
 
-    /* Finally wait for the last child. */
-    waitpid(pids[num_cmds - 1], NULL, 0);
+    uint64_t largest = 0;
+    for (int i = 0; i < NQP_LATENCY_BUCKETS; i++)
+    {
+        if (latency->buckets[i] > largest)
+            largest = latency->buckets[i];
+    }
+    for (int i = 0; i < NQP_LATENCY_BUCKETS; i++)
+    {
+        if (latency->buckets[i] == 0)
+            continue;
 
-    pipeline_mode = 0;
+        /* Bucket i holds calls from 2^(i+7) ns (0 for bucket 0) up to 2^(i+8). */
+        char low[32], high[32], bar[41];
+        format_ns(low, sizeof(low), i == 0 ? 0 : (uint64_t)1 << (i + 7));
+        format_ns(high, sizeof(high), (uint64_t)1 << (i + 8));
+        int width = (int)(latency->buckets[i] * 40 / largest);
+        memset(bar, '#', width > 0 ? width : 1);
+        bar[width > 0 ? width : 1] = '\0';
+        if (i == NQP_LATENCY_BUCKETS - 1)
+            snprintf(buf, sizeof(buf), "  %6s+        %10lu %s\n", low, (unsigned long)latency->buckets[i], bar);
+        else
+            snprintf(buf, sizeof(buf), "  %6s-%-7s %10lu %s\n", low, high, (unsigned long)latency->buckets[i], bar);
+        shell_write(buf);
+    }
+}
+
+/* Built-in: print the file system's counters; "stats -r" also resets them. */
+void handle_stats(char *option)
+{
+    int reset = option && strcmp(option, "-r") == 0;
+    if (option && !reset)
+    {
+        fprintf(stderr, "usage: stats [-r]\n");
+        return;
+    }
+
+    nqp_stats_info stats;
+    if (nqp_stats(&stats, reset) != 0)
+    {
+        fprintf(stderr, "stats: not available\n");
+        return;
+    }
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "device reads       %lu (%lu bytes)\n"
+             "FAT lookups        %lu\n"
+             "dir clusters       %lu\n"
+             "names converted    %lu (%lu allocated)\n"
+             "cluster cache      %lu hits, %lu misses\n"
+             "dentry cache       %lu hits, %lu misses\n",
+             (unsigned long)stats.device_reads, (unsigned long)stats.device_read_bytes,
+             (unsigned long)stats.fat_lookups, (unsigned long)stats.dir_clusters_scanned,
+             (unsigned long)stats.name_conversions, (unsigned long)stats.name_allocations,
+             (unsigned long)stats.cache_hits, (unsigned long)stats.cache_misses,
+             (unsigned long)stats.dcache_hits, (unsigned long)stats.dcache_misses);
+    shell_write(buf);
+    print_latency("open", &stats.open);
+    print_latency("read", &stats.read);
+    print_latency("getdents", &stats.getdents);
 }
 
 /* ============================================================================
@@ -678,13 +1554,17 @@ int main_pipe(int argc, char *argv[], char *envp[])
     }
 
     /* Mount the NQP volume. */
-    nqp_error mount_error = nqp_mount(argv[1], NQP_FS_EXFAT);
+    /* Calls are timed for the stats built-in. */
+    nqp_error mount_error = nqp_mount_with(argv[1], NQP_FS_EXFAT, NQP_MOUNT_TIMING);
     if (mount_error != NQP_OK)
     {
         if (mount_error == NQP_FSCK_FAIL)
             fprintf(stderr, "%s is inconsistent, not mounting.\n", argv[1]);
         exit(EXIT_FAILURE);
     }
+    volume_path = argv[1];
+    if (stat(volume_path, &volume_identity) == -1)
+        volume_path = NULL; /* Can't tell if it changes; trust the cache */
 
     /* Main read/execute loop */
     while (1)
@@ -766,6 +1646,24 @@ int main_pipe(int argc, char *argv[], char *envp[])
             free(line);
             continue;
         }
+        else if (strcmp(tokens[0], "stats") == 0)
+        {
+            handle_stats(tokens[1]);
+            free(line);
+            continue;
+        }
+        else if (strcmp(tokens[0], "status") == 0)
+        {
+            handle_status();
+            free(line);
+            continue;
+        }
+        else if (strcmp(tokens[0], "utilities") == 0)
+        {
+            handle_utilities(tokens[1]);
+            free(line);
+            continue;
+        }
 
         /* If not a built-in, parse for optional "< file". */
         char *cmd_argv[MAX_ARGS];
@@ -800,64 +1698,67 @@ int main_pipe(int argc, char *argv[], char *envp[])
             continue;
         }
 
+        /* cat, head, tail, wc and echo run right here, output and all. */
+        utility_options options;
+        const utility_command *utility = utility_lookup(cmd_argv, &options);
+        if (utility)
+        {
+            stages_reset();
+            stage_finished(cmd_argv[0], utility_run(utility, cmd_argv, &options, input_file));
+            free(line);
+            continue;
+        }
+
+        launch_plan plan;
+        stages_reset();
+        int failed = LaunchPrepare(cmd_argv, input_file, &plan);
+        if (failed)
+        {
+            LaunchRelease(&plan);
+            stage_finished(cmd_argv[0], failed);
+            free(line);
+            continue;
+        }
+
         /* If logging => capture child output in pipe so we can tee it to log. */
         if (log_fd >= 0)
         {
             int final_pipe[2];
-            if (pipe(final_pipe) == -1)
+            if (pipe2(final_pipe, O_CLOEXEC) == -1)
             {
                 perror("pipe");
+                LaunchRelease(&plan);
                 free(line);
                 continue;
             }
-            pid_t pid = fork();
+            pid_t pid = LaunchSpawn(&plan, -1, final_pipe[1]);
+            LaunchRelease(&plan);
+            close(final_pipe[1]);
             if (pid < 0)
             {
-                perror("fork single cmd");
                 close(final_pipe[0]);
-                close(final_pipe[1]);
+                stage_finished(cmd_argv[0], 1);
                 free(line);
                 continue;
             }
-            if (pid == 0)
-            {
-                /* child => write to final_pipe[1], then LaunchFunction. */
-                dup2(final_pipe[1], STDOUT_FILENO);
-                close(final_pipe[0]);
-                close(final_pipe[1]);
-                LaunchFunction(cmd_argv, input_file, -1); /* never returns */
-            }
-            else
-            {
-                /* parent => read from final_pipe[0] */
-                close(final_pipe[1]);
-                char buf[BUFFER_SIZE];
-                ssize_t rcount;
-                while ((rcount = read(final_pipe[0], buf, sizeof(buf))) > 0)
-                {
-                    shell_write_buf(buf, rcount);
-                }
-                close(final_pipe[0]);
-                waitpid(pid, NULL, 0);
-            }
+
+            /* copy final_pipe[0] to stdout and the log */
+            stage_started(cmd_argv[0], pid);
+            relay_output(final_pipe[0]);
+            close(final_pipe[0]);
+            wait_stages();
         }
         else
         {
             /* No logging => child writes directly to stdout. */
-            pid_t pid = fork();
+            pid_t pid = LaunchSpawn(&plan, -1, -1);
+            LaunchRelease(&plan);
             if (pid < 0)
-            {
-                perror("fork single cmd no-log");
-                free(line);
-                continue;
-            }
-            if (pid == 0)
-            {
-                LaunchFunction(cmd_argv, input_file, -1);
-            }
+                stage_finished(cmd_argv[0], 1);
             else
             {
-                waitpid(pid, NULL, 0);
+                stage_started(cmd_argv[0], pid);
+                wait_stages();
             }
         }
 
@@ -865,6 +1766,7 @@ int main_pipe(int argc, char *argv[], char *envp[])
     }
 
     /* Unmount or close log file if needed */
+    file_cache_flush();
     if (log_fd >= 0)
         close(log_fd);
 